@@ -1,9 +1,21 @@
+#pragma once
 #include <cstdint>
 #include <concepts>
 #include <array>
 #include <vector>
 #include <stdexcept>
 #include <cstddef>
+#include <cstring>
+#include <bit>
+#include <algorithm>
+#include <type_traits>
+#include <span>
+#include <atomic>
+#include <string>
+#include <string_view>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#endif
 
 namespace TTFileSystem
 {
@@ -14,6 +26,42 @@ namespace TTFileSystem
     template<typename T, num_t size>
     using array_type = std::array<T, size>;
 
+    inline void prefetch(const void* ptr) noexcept {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        _mm_prefetch(reinterpret_cast<const char*>(ptr), _MM_HINT_T0);
+#elif defined(__GNUC__)
+        __builtin_prefetch(ptr);
+#endif
+    }
+
+    inline num_t hashName(std::string_view name) noexcept {
+        num_t h = 0xcbf29ce484222325ULL;
+        for (char c : name) {
+            h ^= (byte_t)c;
+            h *= 0x100000001b3ULL;
+        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    inline num_t checksum(const byte_t* data, num_t size) noexcept {
+        num_t h = 0xcbf29ce484222325ULL ^ size;
+        num_t i = 0;
+        for (num_t word; i + sizeof(num_t) <= size; i += sizeof(num_t)) {
+            std::memcpy(&word, data + i, sizeof(num_t));
+            h = (h ^ word) * 0x100000001b3ULL;
+            h ^= h >> 29;
+        }
+        for (; i < size; i++)
+            h = (h ^ data[i]) * 0x100000001b3ULL;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+
     namespace Primitives
     {
         constexpr num_t CountBits(num_t t)
@@ -30,6 +78,35 @@ namespace TTFileSystem
         template<num_t Value>
         concept PointerMultipleNumber = (Value % sizeof(num_t) == 0) && (Value >= sizeof(num_t));
 
+        // Slot of a directory hash table; slot 0 of a table holds the entry count
+        // in hash and the capacity in descriptor.
+        struct DirectoryEntry
+        {
+            num_t hash;
+            num_t descriptor; // descriptor index + 1, 0 marks an empty slot
+        };
+
+        struct Extent
+        {
+            num_t start;
+            num_t length;
+
+            num_t end() const noexcept {
+                return start + length;
+            }
+        };
+
+        struct MappedExtent
+        {
+            num_t logical;
+            num_t physical;
+            num_t length;
+
+            num_t end() const noexcept {
+                return logical + length;
+            }
+        };
+
         template<num_t BlockSize>
         requires PointerMultipleNumber<BlockSize>
         struct Block
@@ -55,6 +132,23 @@ namespace TTFileSystem
                 array_type<byte_t, Size> data;
             };
 
+            struct ExtentNode {
+                struct IndexEntry {
+                    num_t logical;
+                    num_t child;
+                };
+
+                constexpr const static num_t LeafSize = (BlockSize - 2 * sizeof(num_t)) / sizeof(MappedExtent);
+                constexpr const static num_t IndexSize = (BlockSize - 2 * sizeof(num_t)) / sizeof(IndexEntry);
+
+                num_t level;
+                num_t count;
+                union {
+                    array_type<MappedExtent, LeafSize> extents;
+                    array_type<IndexEntry, IndexSize> children;
+                };
+            };
+
             constexpr const static num_t Size = BlockSize;
 
             array_type<byte_t, BlockSize> data;
@@ -65,24 +159,53 @@ namespace TTFileSystem
             }
         };
 
-        template<num_t SuperBlockSize, num_t BlockSize>
+        // Without InlineData the blocks live in a separate area of the instance
+        // and data is empty, leaving only the counters and bitmaps.
+        template<num_t SuperBlockSize, num_t BlockSize, bool InlineData = true>
             requires (SuperBlockSize % 8 == 0)
         struct SuperBlock
         {
             constexpr static const num_t BitDataSize = SuperBlockSize / 8;
             constexpr static const num_t BitDataFalloff = BitDataSize % 8;
+            constexpr static const num_t FlagsWordCount = BitDataSize / 8;
             constexpr static const num_t Size = SuperBlockSize;
 
             using BlockType = Block<BlockSize>;
 
             num_t taken_amount;
             array_type<byte_t, BitDataSize> taken_flags;
-            array_type<BlockType, SuperBlockSize> data;
+            array_type<num32_t, SuperBlockSize> shares; // owners of a taken block beyond the first
+            [[no_unique_address]] array_type<BlockType, InlineData ? SuperBlockSize : 0> data;
 
             void initEmpty() noexcept {
                 taken_amount = 0;
                 for (num_t i = 0; i < BitDataSize; i++)
                     taken_flags[i] = 0;
+                shares.fill(0);
+            }
+
+            bool shared(num_t index) noexcept {
+                return std::atomic_ref<num32_t>(shares[index]).load(std::memory_order_acquire) != 0;
+            }
+
+            void share(num_t index) noexcept {
+                std::atomic_ref<num32_t>(shares[index]).fetch_add(1, std::memory_order_relaxed);
+            }
+
+            // Gives up one extra owner; false when the caller is the last one.
+            bool dropShare(num_t index) noexcept {
+                std::atomic_ref<num32_t> refs(shares[index]);
+                num32_t value = refs.load(std::memory_order_acquire);
+                while (value != 0)
+                    if (refs.compare_exchange_weak(value, value - 1, std::memory_order_acq_rel, std::memory_order_acquire))
+                        return true;
+                return false;
+            }
+
+            num_t nextShared(num_t index, num_t end) noexcept {
+                while (index < end && std::atomic_ref<num32_t>(shares[index]).load(std::memory_order_relaxed) == 0)
+                    index++;
+                return index;
             }
 
             inline constexpr bool isTaken(num_t index) const noexcept {
@@ -90,7 +213,7 @@ namespace TTFileSystem
             }
 
             inline constexpr void allocBlock(num_t index) {
-                if (index > Size)
+                if (index >= Size)
                     throw new std::out_of_range("Unreacheble block");
 
                 if (isTaken(index))
@@ -101,7 +224,7 @@ namespace TTFileSystem
             }
 
             inline constexpr void freeBlock(num_t index) {
-                if (index > Size)
+                if (index >= Size)
                     throw new std::out_of_range("Unreacheble block");
 
                 if (!isTaken(index))
@@ -113,38 +236,243 @@ namespace TTFileSystem
                 taken_flags[index / 8] &= a;
             }
 
-            num_t firstFreeIndex() {
-                array_type<num_t, BitDataSize / 8>& pdat = (array_type<num_t, BitDataSize / 8>&)(data);
-                for (num_t b = 0; b < BitDataSize / 8; b++)
-                    if (pdat[b] != 0xffffffffffffffff)
-                    {
-                        num_t index = b << 3;
-                        for (num_t i = 0; i < 8; i++)
-                        {
-                            auto& flag = taken_flags[i | index];
-                            if (flag != (byte_t)(0xffff))
-                                for (num_t j = 0; j < 8; j++)
-                                {
-                                    byte_t shifted = flag >> j;
-                                    if (shifted % 2 == 0)
-                                        return ((i | index) << 3) | j;
-                                }
-                        }
-                    }
+            inline num_t loadFlagsWord(num_t word) const noexcept {
+                num_t res;
+                std::memcpy(&res, taken_flags.data() + (word << 3), sizeof(num_t));
+                return res;
+            }
+
+            num_t firstFreeIndex() const noexcept {
+                for (num_t w = 0; w < FlagsWordCount; w++) {
+                    num_t word = loadFlagsWord(w);
+                    if (word != ~num_t(0))
+                        return (w << 6) | std::countr_one(word);
+                }
                 for (num_t i = BitDataSize - BitDataFalloff; i < BitDataSize; i++)
-                {
-                    if (taken_flags[i] != (byte_t)(0xffff))
-                        for (num_t j = 0; j < 8; j++)
-                        {
-                            byte_t shifted = taken_flags[i] >> j;
-                            if (shifted % 2 == 0)
-                                return (i << 3) | j;
-                        }
+                    if (taken_flags[i] != (byte_t)(0xff))
+                        return (i << 3) | std::countr_one(taken_flags[i]);
+                return Size;
+            }
+
+            num_t peekFlags(num_t index) const noexcept {
+                array_type<byte_t, 16> buf;
+                buf.fill(0xff);
+                num_t byte = index >> 3;
+                if (byte < BitDataSize)
+                    std::memcpy(buf.data(), taken_flags.data() + byte, std::min<num_t>(9, BitDataSize - byte));
+                num_t lo, hi;
+                std::memcpy(&lo, buf.data(), sizeof(num_t));
+                std::memcpy(&hi, buf.data() + 8, sizeof(num_t));
+                num_t shift = index & 7;
+                return shift == 0 ? lo : (lo >> shift) | (hi << (64 - shift));
+            }
+
+            num_t nextFreeIndex(num_t index) const noexcept {
+                while (index < Size) {
+                    num_t taken = std::countr_one(peekFlags(index));
+                    if (taken < 64)
+                        return std::min(index + taken, Size);
+                    index += 64;
                 }
                 return Size;
             }
+
+            num_t freeRunLength(num_t index, num_t max) const noexcept {
+                num_t res = 0;
+                while (res < max) {
+                    num_t run = std::countr_zero(peekFlags(index + res));
+                    res += run;
+                    if (run < 64)
+                        break;
+                }
+                return std::min(res, max);
+            }
+
+            num_t takenInRange(num_t index, num_t count) const noexcept {
+                num_t res = 0;
+                while (count > 0) {
+                    num_t step = std::min<num_t>(count, 64);
+                    num_t bits = peekFlags(index);
+                    if (step < 64)
+                        bits &= (1ULL << step) - 1;
+                    res += std::popcount(bits);
+                    index += step;
+                    count -= step;
+                }
+                return res;
+            }
+
+            template<bool Value>
+            void fillRange(num_t index, num_t count) noexcept {
+                num_t end = index + count;
+                while (index < end && (index & 7) != 0) {
+                    if constexpr (Value)
+                        taken_flags[index >> 3] |= (byte_t)(1U << (index & 7));
+                    else
+                        taken_flags[index >> 3] &= (byte_t)~(1U << (index & 7));
+                    index++;
+                }
+                if (end - index >= 8) {
+                    std::memset(taken_flags.data() + (index >> 3), Value ? 0xff : 0, (end - index) >> 3);
+                    index += (end - index) & ~num_t(7);
+                }
+                for (; index < end; index++) {
+                    if constexpr (Value)
+                        taken_flags[index >> 3] |= (byte_t)(1U << (index & 7));
+                    else
+                        taken_flags[index >> 3] &= (byte_t)~(1U << (index & 7));
+                }
+            }
+
+            void allocRange(num_t index, num_t count) {
+                if (index + count > Size)
+                    throw new std::out_of_range("Unreacheble block");
+
+                if (takenInRange(index, count) != 0)
+                    throw new std::bad_alloc();
+
+                taken_amount += count;
+                fillRange<true>(index, count);
+            }
+
+            void freeRange(num_t index, num_t count) {
+                if (index + count > Size)
+                    throw new std::out_of_range("Unreacheble block");
+
+                if (takenInRange(index, count) != count)
+                    throw new std::bad_alloc();
+
+                taken_amount -= count;
+                fillRange<false>(index, count);
+            }
+
+            template<typename Word>
+            static num_t claimRun(Word& target, num_t max, num_t& first) noexcept {
+                constexpr const num_t Bits = sizeof(Word) * 8;
+                std::atomic_ref<Word> word(target);
+                Word value = word.load(std::memory_order_relaxed);
+                while (value != (Word)~Word(0)) {
+                    num_t start = std::countr_one(value);
+                    num_t run = std::min<num_t>({ (num_t)std::countr_zero((Word)(value >> start)), Bits - start, max });
+                    Word mask = run == Bits ? (Word)~Word(0) : (Word)((((Word)1 << run) - 1) << start);
+                    if (word.compare_exchange_weak(value, (Word)(value | mask), std::memory_order_acq_rel, std::memory_order_relaxed)) {
+                        first = start;
+                        return run;
+                    }
+                }
+                return 0;
+            }
+
+            template<typename Word>
+            static num_t releaseBits(Word& target, Word mask) noexcept {
+                return std::popcount((Word)(std::atomic_ref<Word>(target).fetch_and((Word)~mask, std::memory_order_acq_rel) & mask));
+            }
+
+            num_t& flagsWord(num_t word) noexcept {
+                return reinterpret_cast<num_t&>(taken_flags[word << 3]);
+            }
+
+            num_t takenConcurrent() noexcept {
+                return std::atomic_ref<num_t>(taken_amount).load();
+            }
+
+            num_t allocConcurrent(num_t max, num_t& first) noexcept {
+                for (num_t w = 0; w < FlagsWordCount; w++) {
+                    num_t start;
+                    num_t run = claimRun(flagsWord(w), max, start);
+                    if (run != 0) {
+                        std::atomic_ref<num_t>(taken_amount).fetch_add(run, std::memory_order_relaxed);
+                        first = (w << 6) + start;
+                        return run;
+                    }
+                }
+                for (num_t i = BitDataSize - BitDataFalloff; i < BitDataSize; i++) {
+                    num_t start;
+                    num_t run = claimRun(taken_flags[i], max, start);
+                    if (run != 0) {
+                        std::atomic_ref<num_t>(taken_amount).fetch_add(run, std::memory_order_relaxed);
+                        first = (i << 3) + start;
+                        return run;
+                    }
+                }
+                return 0;
+            }
+
+            void freeRangeConcurrent(num_t index, num_t count) {
+                if (index + count > Size)
+                    throw new std::out_of_range("Unreacheble block");
+
+                num_t released = 0;
+                for (num_t end = index + count; index < end;) {
+                    if ((index >> 6) < FlagsWordCount) {
+                        num_t bits = std::min<num_t>(64 - (index & 63), end - index);
+                        num_t mask = bits == 64 ? ~0ULL : ((1ULL << bits) - 1) << (index & 63);
+                        released += releaseBits(flagsWord(index >> 6), mask);
+                        index += bits;
+                    }
+                    else {
+                        num_t bits = std::min<num_t>(8 - (index & 7), end - index);
+                        released += releaseBits(taken_flags[index >> 3], (byte_t)(((1U << bits) - 1) << (index & 7)));
+                        index += bits;
+                    }
+                }
+                std::atomic_ref<num_t>(taken_amount).fetch_sub(released);
+                if (released != count)
+                    throw new std::bad_alloc();
+            }
         };
 
+        // Names of up to InlineSize bytes are kept in place; longer ones live in the
+        // instance's string heap and only their location is stored here.
+        struct NameRef
+        {
+            constexpr const static num_t InlineSize = 15;
+            constexpr const static byte_t External = 0xFF;
+
+            num_t hash;
+            array_type<char, InlineSize + 1> data; // last byte: inline length or External
+
+            void initEmpty() {
+                hash = 0;
+                data.fill(0);
+            }
+
+            bool external() const {
+                return (byte_t)data[InlineSize] == External;
+            }
+
+            num_t length() const {
+                if (!external())
+                    return (byte_t)data[InlineSize];
+                num32_t res;
+                std::memcpy(&res, data.data() + sizeof(num_t), sizeof(num32_t));
+                return res;
+            }
+
+            num_t heapOffset() const {
+                num_t res;
+                std::memcpy(&res, data.data(), sizeof(num_t));
+                return res;
+            }
+
+            void setInline(std::string_view name, num_t name_hash) {
+                hash = name_hash;
+                data.fill(0);
+                std::memcpy(data.data(), name.data(), name.size());
+                data[InlineSize] = (char)name.size();
+            }
+
+            void setExternal(num_t offset, num32_t name_length, num_t name_hash) {
+                hash = name_hash;
+                data.fill(0);
+                std::memcpy(data.data(), &offset, sizeof(num_t));
+                std::memcpy(data.data() + sizeof(num_t), &name_length, sizeof(num32_t));
+                data[InlineSize] = (char)External;
+            }
+        };
+
+        static_assert(sizeof(NameRef) == 24);
+
         struct Descriptor
         {
             struct SecurityAttributes
@@ -167,49 +495,131 @@ namespace TTFileSystem
             };
             struct FileHeader
             {
+                enum Layout : num32_t
+                {
+                    Indirect = 0,
+                    Extents = 1,
+                    MappingMask = 0xFF,
+                    // Small files keep their bytes in FileData or in a heap record.
+                    Inline = 0x100,
+                    Packed = 0x200,
+                    StorageMask = 0x300,
+                    // Set on both sides of a clone while blocks may still be shared.
+                    Shared = 0x400,
+                    // Set while a directory entry refers to the file.
+                    Linked = 0x800,
+                };
+
                 num_t size;
                 num_t creation_time;
-                num_t name_ptr;
+                NameRef name;
+                num32_t layout;
+                num32_t extent_count;
+                num_t blocks;
 
                 void initEmpty() {
                     size = 0;
                     creation_time = 0;
-                    name_ptr = 0;
+                    name.initEmpty();
+                    layout = Indirect;
+                    extent_count = 0;
+                    blocks = 0;
                 }
             };
             struct FileData
             {
+                constexpr const static num_t ExtraSlots = 4;
+
                 num_t data_0_ptr;
                 num_t data_1_ptr;
                 num_t data_2_ptr;
                 num_t data_3_ptr;
+                array_type<num_t, ExtraSlots> extra;
 
                 void initEmpty() {
                     data_0_ptr = 0;
                     data_1_ptr = 0;
                     data_2_ptr = 0;
                     data_3_ptr = 0;
+                    extra.fill(0);
                 }
             };
+            struct ExtentData
+            {
+                constexpr const static num_t InlineCount = 2;
+
+                num_t tree_ptr;
+                array_type<MappedExtent, InlineCount> runs;
+            };
 
             SecurityAttributes attributes;
             FileHeader header;
-            FileData data;
+            // The layout in the header says which one is in use.
+            union {
+                FileData data;
+                ExtentData extent_data;
+            };
 
             void initEmpty() {
                 header.initEmpty();
                 data.initEmpty();
             }
+
+            ExtentData& extents() {
+                return extent_data;
+            }
         };
 
+        // Extent runs share the pointer slots. The header alone fills the first
+        // 64 bytes, and a descriptor must not cross a descriptor page.
+        static_assert(sizeof(Descriptor::ExtentData) <= sizeof(Descriptor::FileData));
+        static_assert(sizeof(Descriptor::SecurityAttributes) + sizeof(Descriptor::FileHeader) == 64);
+        static_assert(sizeof(Descriptor) == 128);
+
         struct Header
         {
+            constexpr const static num_t Magic = 0x344D495346545454ULL;
+
+            num_t magic;
+            num_t block_size;
+            num_t super_block_size;
+            num_t descriptors_count; // in use; the instance type may hold more
+            num_t super_block_count; // in use; grows without moving any block
+            num_t root_descriptor; // index + 1, 0 until the root directory is created
+            num_t heap_descriptor; // index + 1 of the string heap file, created on demand
+            num_t checkpoint_sequence; // checkpoints taken since the instance was formatted
+            num_t blocks_offset; // image offset of block 0, which the layout decides
+
+            array_type<num_t, 1> user_data;
+        };
+
+        // Incremental checkpoint file: the header, region_count image ranges as
+        // Extents of bytes, then the bytes of every range in the same order.
+        struct CheckpointHeader
+        {
+            constexpr const static num_t Magic = 0x31544C4453465454ULL;
+
+            num_t magic;
             num_t block_size;
             num_t super_block_size;
             num_t descriptors_count;
             num_t super_block_count;
+            num_t base_sequence; // checkpoint_sequence of the state it applies to
+            num_t region_count;
+        };
+
+        // Metadata journal record: the header, region_count image ranges as
+        // Extents of bytes, then their bytes; size and checksum cover all of it
+        // after the header.
+        struct JournalRecord
+        {
+            constexpr const static num_t Magic = 0x314C4E524A465454ULL;
 
-            array_type<num_t, 4> user_data;
+            num_t magic;
+            num_t sequence;
+            num_t region_count;
+            num_t size;
+            num_t checksum;
         };
     }
 }
\ No newline at end of file
@@ -1,27 +1,201 @@
+#pragma once
 #include "fsheaders.hpp"
+#include "fsplatform.hpp"
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <optional>
+#include <utility>
 
 namespace TTFileSystem
 {
 	template<num_t SuperBlockSize, num_t SuperBlockCount>
 	constexpr const num_t DefaultDescriptorsCount = SuperBlockCount * SuperBlockSize / 4;
 
-	template<num_t BlockSize, num_t SuperBlockSize, num_t SuperBlockCount, num_t DescriptorCount = DefaultDescriptorsCount<SuperBlockSize, SuperBlockCount>>
+	// With a DataAlignment the counters and bitmaps of all superblocks follow
+	// the descriptors back to back and the blocks form one array starting on a
+	// DataAlignment boundary of the image. Without one every superblock keeps
+	// its blocks right behind its bitmaps.
+	template<num_t BlockSize, num_t SuperBlockSize, num_t SuperBlockCount, num_t DescriptorCount = DefaultDescriptorsCount<SuperBlockSize, SuperBlockCount>, num_t DataAlignment = 0>
 	struct MemoryInstance
 	{
+		static_assert(DataAlignment == 0 || std::has_single_bit(DataAlignment), "Data alignment must be a power of two");
 	public:
-		using SuperBlockType = Primitives::SuperBlock<SuperBlockSize, BlockSize>;
+		using SuperBlockType = Primitives::SuperBlock<SuperBlockSize, BlockSize, DataAlignment == 0>;
 		using BlockType = SuperBlockType::BlockType;
 		using PtrBlockType = BlockType::PointerBlock;
 		using NameBlock = BlockType::NameBlock;
+		using ExtentNode = BlockType::ExtentNode;
 
-		constexpr const static num_t TotalSize = sizeof(Primitives::Header) + DescriptorCount * sizeof(Primitives::Descriptor) + SuperBlockCount * sizeof(SuperBlockType);
+		constexpr const static bool SplitLayout = DataAlignment != 0;
 		constexpr const static num_t BlockCount = SuperBlockSize * SuperBlockCount;
 
 		constexpr const static num_t SuperBlocksOffset = sizeof(Primitives::Header) + DescriptorCount * sizeof(Primitives::Descriptor);
-		constexpr const static num_t BlockOffset = offsetof(SuperBlockType, data);
+		constexpr const static num_t SuperBlockMetadataSize = SplitLayout ? sizeof(SuperBlockType) : offsetof(SuperBlockType, data);
+		constexpr const static num_t BlocksOffset = SplitLayout
+			? (SuperBlocksOffset + SuperBlockCount * sizeof(SuperBlockType) + DataAlignment - 1) / DataAlignment * DataAlignment
+			: SuperBlocksOffset + SuperBlockMetadataSize;
 		constexpr const static num_t DescriptorsOffset = sizeof(Primitives::Header);
+		constexpr const static num_t TotalSize = SplitLayout ? BlocksOffset + BlockCount * BlockSize : SuperBlocksOffset + SuperBlockCount * sizeof(SuperBlockType);
+
+		constexpr const static num_t FreeSummaryWords = (SuperBlockCount + 63) / 64;
+		constexpr const static num_t DescriptorWords = (DescriptorCount + 63) / 64;
+		constexpr const static num_t AllocationShards = 64;
+		constexpr const static num_t ShardStride = std::max<num_t>(SuperBlockCount / AllocationShards, 1);
+		constexpr const static num_t LockStripes = 1024;
+		constexpr const static num_t DescriptorPageSize = 4096;
+		constexpr const static num_t DescriptorPages = (DescriptorCount * sizeof(Primitives::Descriptor) + DescriptorPageSize - 1) / DescriptorPageSize;
+		constexpr const static num_t DefaultCommitInterval = 64;
+		constexpr const static num_t JournalLimit = 64 << 20;
+		constexpr const static num_t LoadChunk = 4 << 20;
+		constexpr const static num_t CacheReadAhead = 16;
+		constexpr const static num_t ReclaimBatch = 4 << 20;
+		constexpr const static num_t FormatGrain = 4096;
+
+		// Guards every descriptor whose index maps to the stripe; readers hold it
+		// shared.
+		struct alignas(64) FileLock {
+			std::shared_mutex mutex;
+		};
+
+		// A stripe the calling thread holds; write guards chain them innermost
+		// first, so a nested guard on any of them does not lock it again.
+		struct HeldLock {
+			FileLock* lock;
+			HeldLock* previous;
+		};
+
+		// Direct-mapped cache of recent (directory, name) -> descriptor lookups.
+		struct DentryCache {
+			constexpr const static num_t Size = 4096;
+
+			struct Slot {
+				num_t parent;
+				num_t child;
+				std::string name;
+			};
+
+			std::mutex mutex;
+			array_type<Slot, Size> slots{};
+
+			static num_t slotOf(num_t parent, std::string_view name) {
+				return (hashName(name) ^ parent * 0x9E3779B97F4A7C15ULL) & (Size - 1);
+			}
+		};
+
+		// Redo log of a journaled image. Operations hold the gate shared and a
+		// commit holds it exclusively, so a record never splits an operation.
+		struct Journal {
+			Platform::FileHandle log;
+			num_t log_size = 0;
+			num_t sequence = 0;
+			num_t commit_interval = 0;
+			std::atomic<num_t> pending{ 0 };
+			std::shared_mutex gate;
+
+			// Changed since the last commit; metadata blocks go to the log, other
+			// blocks straight to the image.
+			std::vector<num_t> blocks = std::vector<num_t>((BlockCount + 63) / 64);
+			std::vector<num_t> metadata = std::vector<num_t>((BlockCount + 63) / 64);
+			std::vector<num_t> descriptors = std::vector<num_t>(DescriptorWords);
+			std::vector<num_t> super_blocks = std::vector<num_t>(FreeSummaryWords);
+			// Blocks in a record of the current log. Replay would overwrite them
+			// with that record, so they stay journaled even once they hold data.
+			std::vector<num_t> logged = std::vector<num_t>((BlockCount + 63) / 64);
+		};
+
+		// Residency of a cached instance, tracked in units of whole pages. Units
+		// holding the header, descriptors or superblock bitmaps are pinned; the
+		// rest are read on first access and evicted by a generalized CLOCK in
+		// which pointer blocks and extent nodes start with a higher count.
+		struct Cache {
+			constexpr const static byte_t DataWeight = 1;
+			constexpr const static byte_t MetadataWeight = 3;
+
+			num_t unit = 0;
+			num_t units = 0;
+			num_t capacity = 0;
+			std::vector<byte_t> state; // 0 if absent, otherwise 1 + CLOCK count
+			std::vector<num_t> pinned;
+			std::vector<num_t> dirty;
+			num_t pinned_count = 0;
+			num_t resident = 0;
+			num_t hand = 0;
+			num_t next_miss = 0;
+			num_t depth = 0;
+			num_t hits = 0;
+			num_t misses = 0;
+			num_t evictions = 0;
+			num_t write_backs = 0;
+		};
+
+		struct CacheStats {
+			num_t hits;
+			num_t misses;
+			num_t evictions;
+			num_t write_backs;
+			num_t resident_bytes;
+		};
 	public:
+		// Stands in for unallocated blocks in forEachSpan; never written.
+		inline static BlockType zero_block_{};
+		inline static thread_local BlockType small_block_{};
+
 		byte_t* data_;
+		array_type<num_t, FreeSummaryWords> free_summary_;
+		Platform::MappedFile mapping_{};
+		bool concurrent_ = false;
+
+		// Superblocks and descriptors in use, as recorded in the header; the
+		// template sizes are the capacity they can grow to.
+		num_t super_block_count_ = SuperBlockCount;
+		num_t descriptor_count_ = DescriptorCount;
+
+		// Bit per descriptor with EX set; rebuilt from the table on load.
+		std::vector<num_t> live_descriptors_;
+		num_t descriptor_hint_ = 0;
+		num_t file_count_ = 0;
+		std::unique_ptr<DentryCache> dentries_ = std::make_unique<DentryCache>();
+
+		// Bit per block, descriptor page and superblock bitmap area changed since
+		// the last checkpoint; the header goes into every checkpoint.
+		std::vector<num_t> dirty_blocks_ = std::vector<num_t>((BlockCount + 63) / 64);
+		std::vector<num_t> dirty_descriptors_ = std::vector<num_t>((DescriptorPages + 63) / 64);
+		std::vector<num_t> dirty_super_blocks_ = std::vector<num_t>(FreeSummaryWords);
+		std::unique_ptr<Journal> journal_;
+		// Image I/O of a mapped, journaled or loaded instance; a loaded one also
+		// owns the image file.
+		std::unique_ptr<Platform::AsyncIO> io_;
+		Platform::FileHandle backing_{};
+		std::unique_ptr<Cache> cache_;
+		Platform::MemoryPolicy memory_policy_{};
+		// Blocks freed since the last reclaim pass; empty unless reclaiming.
+		std::vector<num_t> freed_blocks_;
+		num_t freed_count_ = 0;
+		num_t reclaim_granule_ = 0;
+		// Per superblock, the first block from which every block is still zero
+		// as formatted; empty when nothing is known, as for opened images.
+		std::vector<num_t> fresh_from_;
+
+		// Superblock the concurrent allocator tries first, per shard of threads;
+		// each thread keeps the shard it was given first.
+		array_type<num_t, AllocationShards> alloc_hints_{};
+		inline static thread_local num_t alloc_shard_ = AllocationShards;
+		inline static std::atomic<num_t> shard_counter_{ 0 };
+		inline static thread_local HeldLock* held_locks_ = nullptr;
+		inline static thread_local num_t guard_depth_ = 0;
+		std::unique_ptr<array_type<FileLock, LockStripes>> file_locks_;
+		std::unique_ptr<std::mutex> heap_mutex_;
+
+		FileLock& fileLock(num_t descriptor) {
+			return (*file_locks_)[descriptor % LockStripes];
+		}
+
+		// The string heap is guarded by its own mutex instead of its stripe.
+		// Heap changes take no other lock, so whoever holds it never waits.
+		std::unique_lock<std::mutex> heapLock() {
+			return concurrent_ ? std::unique_lock(*heap_mutex_) : std::unique_lock<std::mutex>();
+		}
 
 		template<typename T>
 		T* getOffsetedPtr(num_t offset, num_t index)
@@ -36,14 +210,14 @@ namespace TTFileSystem
 
 		Primitives::Descriptor& getDescriptor(num_t index = 0)
 		{
-			if (index >= DescriptorCount)
+			if (index >= descriptor_count_)
 				throw new std::out_of_range("Accessing non descriptor data.");
 			return *getOffsetedPtr<Primitives::Descriptor>(DescriptorsOffset, index);
 		}
 
 		SuperBlockType& getSuperBlock(num_t index = 0)
 		{
-			if (index >= SuperBlockCount)
+			if (index >= super_block_count_)
 				throw new std::out_of_range("Accessing non instance data.");
 			return *getOffsetedPtr<SuperBlockType>(SuperBlocksOffset, index);
 		}
@@ -52,15 +226,26 @@ namespace TTFileSystem
 			return getSuperBlock(global_index / SuperBlockSize);
 		}
 
-		BlockType& getBlock(num_t global_index)
+		BlockType& getBlock(num_t global_index, byte_t weight = Cache::DataWeight)
 		{
-			if (global_index >= BlockCount)
+			if (global_index >= super_block_count_ * SuperBlockSize)
 				throw new std::out_of_range("Accessing non instance data.");
-			return *getOffsetedPtr<BlockType>(SuperBlocksOffset + sizeof(SuperBlockType) * (global_index / SuperBlockSize) + BlockOffset, global_index % SuperBlockSize);
+			if (cache_)
+				cacheAccess(blockOffset(global_index), BlockSize, weight);
+			return *blockAddress(global_index);
+		}
+
+		// Where a block lives, without reading it into the cache; for prefetches.
+		BlockType* blockAddress(num_t global_index) {
+			return reinterpret_cast<BlockType*>(data_ + blockOffset(global_index));
 		}
 
 		PtrBlockType& getPtrBlock(num_t global_index) {
-			return reinterpret_cast<PtrBlockType&>(getBlock(global_index));
+			return reinterpret_cast<PtrBlockType&>(getBlock(global_index, Cache::MetadataWeight));
+		}
+
+		ExtentNode& getExtentNode(num_t global_index) {
+			return reinterpret_cast<ExtentNode&>(getBlock(global_index, Cache::MetadataWeight));
 		}
 
 		constexpr static num_t CPower(num_t Number, num_t Power) {
@@ -84,6 +269,8 @@ namespace TTFileSystem
 			PtrBlockType* f_block = &block;
 			for (num_t i = Depth; i > 0; i--) {
 				num_t addr = index / power;
+				if (f_block->ptrs[addr] == 0)
+					return 0;
 				f_block = &getPtrBlock(f_block->ptrs[addr]);
 				index %= power;
 				power /= block.Size;
@@ -92,384 +279,3337 @@ namespace TTFileSystem
 			return f_block->ptrs[index];
 		}
 
+		static const Primitives::MappedExtent* findExtent(const Primitives::MappedExtent* extents, num_t count, num_t logical) {
+			auto it = std::upper_bound(extents, extents + count, logical, [](num_t value, const Primitives::MappedExtent& e) { return value < e.logical; });
+			if (it == extents)
+				return nullptr;
+			--it;
+			return logical < it->end() ? it : nullptr;
+		}
+
+		const Primitives::MappedExtent* getExtent(Primitives::Descriptor& desc, num_t ptr_index) {
+			auto& ext = desc.extents();
+			if (ext.tree_ptr == 0)
+				return findExtent(ext.runs.data(), std::min<num_t>(desc.header.extent_count, ext.runs.size()), ptr_index);
+
+			ExtentNode* node = &getExtentNode(ext.tree_ptr);
+			for (num_t depth = 0; node->level > 0; depth++) {
+				if (depth > 64)
+					throw new std::out_of_range("Corrupted extent tree");
+				auto it = std::upper_bound(node->children.begin(), node->children.begin() + std::min<num_t>(node->count, ExtentNode::IndexSize), ptr_index, [](num_t value, const auto& e) { return value < e.logical; });
+				if (it != node->children.begin())
+					--it;
+				node = &getExtentNode(it->child);
+			}
+			return findExtent(node->extents.data(), std::min<num_t>(node->count, ExtentNode::LeafSize), ptr_index);
+		}
+
+		num_t getExtentPtr(Primitives::Descriptor& desc, num_t ptr_index) {
+			auto extent = getExtent(desc, ptr_index);
+			return extent != nullptr ? extent->physical + (ptr_index - extent->logical) : 0;
+		}
+
 		num_t getIndexedPtr(num_t descriptor_index, num_t ptr_index) {
 			constexpr const num_t Size0 = 1;
 			constexpr const num_t Size1 = PtrBlockType::Size;
 			constexpr const num_t Size2 = Size1 * PtrBlockType::Size;
 			constexpr const num_t Size3 = Size2 * PtrBlockType::Size;
 
-			auto desc = getDescriptor(descriptor_index);
+			auto& desc = getDescriptor(descriptor_index);
+
+			if ((desc.header.layout & desc.header.MappingMask) == desc.header.Extents)
+				return getExtentPtr(desc, ptr_index);
 
 			if (ptr_index < Size0)
 				return desc.data.data_0_ptr;
 
 			ptr_index -= Size0;
 			if (ptr_index < Size1)
-				return getPtrBlock(desc.data.data_1_ptr).ptrs[ptr_index];
+				return desc.data.data_1_ptr != 0 ? getPtrBlock(desc.data.data_1_ptr).ptrs[ptr_index] : 0;
 
 			ptr_index -= Size1;
 			if (ptr_index < Size2) {
-				return getIndexedPtr<1>(getPtrBlock(desc.data.data_2_ptr), ptr_index);
+				return desc.data.data_2_ptr != 0 ? getIndexedPtr<1>(getPtrBlock(desc.data.data_2_ptr), ptr_index) : 0;
 			}
 
 			ptr_index -= Size2;
 			if (ptr_index < Size3) {
-				return getIndexedPtr<2>(getPtrBlock(desc.data.data_3_ptr), ptr_index);
+				return desc.data.data_3_ptr != 0 ? getIndexedPtr<2>(getPtrBlock(desc.data.data_3_ptr), ptr_index) : 0;
 			}
+
+			throw new std::out_of_range("Unindexed block");
 		}
 
-		num_t getFreeBlock() {
-			for (num_t i = 0; i < SuperBlockCount; i++)
-				if (getSuperBlock(i).taken_amount < SuperBlockSize) {
-					return getSuperBlock(i).firstFreeIndex() + i * SuperBlockSize;
+		void updateFreeSummary(num_t super_block) {
+			num_t& word = free_summary_[super_block >> 6];
+			num_t bit = 1ULL << (super_block & 63);
+			if (getSuperBlock(super_block).taken_amount < SuperBlockSize)
+				word |= bit;
+			else
+				word &= ~bit;
+		}
+
+		void rebuildFreeSummary() {
+			free_summary_.fill(0);
+			for (num_t i = 0; i < super_block_count_; i++)
+				updateFreeSummary(i);
+		}
+
+		void rebuildDescriptorIndex() {
+			live_descriptors_.assign(DescriptorWords, 0);
+			descriptor_hint_ = 0;
+			file_count_ = 0;
+			for (num_t i = 0; i < descriptor_count_; i++)
+				if (getDescriptor(i).attributes.flags & Primitives::Descriptor::SecurityAttributes::EX) {
+					live_descriptors_[i >> 6] |= 1ULL << (i & 63);
+					file_count_++;
 				}
-			throw new std::bad_alloc();
 		}
 
-		template<num_t EmptifyAmount = 0>
-		num_t allocateSingleBlock() {
-			num_t free = getFreeBlock();
-			SuperBlockType& sb = getSuperBlockByBlockIndex(free);
-			sb.allocBlock(free % SuperBlockSize);
-			auto& b = getBlock(free);
-			for (num_t i = 0; i < EmptifyAmount; i++)
-				b.data[i] = 0;
-			return free;
+		bool claimDescriptor(num_t index) {
+			if (index >= descriptor_count_)
+				throw new std::out_of_range("Accessing non descriptor data.");
+			num_t bit = 1ULL << (index & 63);
+			if (std::atomic_ref<num_t>(live_descriptors_[index >> 6]).fetch_or(bit, std::memory_order_acq_rel) & bit)
+				return false;
+			std::atomic_ref<num_t>(file_count_).fetch_add(1, std::memory_order_relaxed);
+			return true;
 		}
 
-		void freeSingleBlock(num_t block) {
-			SuperBlockType& sb = getSuperBlockByBlockIndex(block);
-			sb.freeBlock(block % SuperBlockSize);
+		void releaseDescriptor(num_t index) {
+			num_t bit = 1ULL << (index & 63);
+			if (!(std::atomic_ref<num_t>(live_descriptors_[index >> 6]).fetch_and(~bit, std::memory_order_acq_rel) & bit))
+				return;
+			std::atomic_ref<num_t>(file_count_).fetch_sub(1, std::memory_order_relaxed);
+			std::atomic_ref<num_t> hint(descriptor_hint_);
+			num_t current = hint.load(std::memory_order_relaxed);
+			while (current > (index >> 6) && !hint.compare_exchange_weak(current, index >> 6, std::memory_order_relaxed));
 		}
 
-		byte_t* transfer()
-		{
-			auto tmp = data_;
-			data_ = nullptr;
-			return tmp;
+		// Claims the lowest free descriptor; words below the hint are known full.
+		num_t acquireDescriptor() {
+			std::atomic_ref<num_t> hint(descriptor_hint_);
+			num_t first = hint.load(std::memory_order_relaxed);
+			for (num_t w = first; w < DescriptorWords; w++) {
+				std::atomic_ref<num_t> word(live_descriptors_[w]);
+				num_t value = word.load(std::memory_order_relaxed);
+				while (~value != 0) {
+					num_t bit = std::countr_one(value);
+					if ((w << 6) + bit >= descriptor_count_)
+						break;
+					if (word.compare_exchange_weak(value, value | (1ULL << bit), std::memory_order_acq_rel, std::memory_order_relaxed)) {
+						if (w != first)
+							hint.compare_exchange_strong(first, w, std::memory_order_relaxed);
+						std::atomic_ref<num_t>(file_count_).fetch_add(1, std::memory_order_relaxed);
+						return (w << 6) + bit;
+					}
+				}
+			}
+			throw new std::bad_alloc();
 		}
 
-	public:
-		MemoryInstance()
-		{
-			data_ = (byte_t*)malloc(TotalSize);
-			auto bl = getBlock(0);
-			for (auto&& i : bl.data)
-				i = 0;
-			for (num_t i = 0; i < SuperBlockCount; i++)
-				getSuperBlock(i).initEmpty();
-			getSuperBlock(0).allocBlock(0);
-			for (num_t i = 0; i < DescriptorCount; i++)
-				getDescriptor(i).attributes.flags = 0;
+		// Returns the cached child descriptor + 1, or 0 on a miss.
+		num_t cachedDentry(num_t parent, std::string_view name) {
+			std::unique_lock guard(dentries_->mutex, std::defer_lock);
+			if (concurrent_)
+				guard.lock();
+			auto& slot = dentries_->slots[DentryCache::slotOf(parent, name)];
+			return slot.parent == parent && slot.name == name ? slot.child + 1 : 0;
 		}
 
-		MemoryInstance(const MemoryInstance&) = delete;
-		MemoryInstance(MemoryInstance&& a)
-		{
-			if (&a != this)
-				data_ = transfer();
+		void cacheDentry(num_t parent, std::string_view name, num_t child) {
+			std::unique_lock guard(dentries_->mutex, std::defer_lock);
+			if (concurrent_)
+				guard.lock();
+			auto& slot = dentries_->slots[DentryCache::slotOf(parent, name)];
+			slot.parent = parent;
+			slot.child = child;
+			slot.name = name;
 		}
 
-		MemoryInstance& operator=(const MemoryInstance&) = delete;
-		MemoryInstance& operator=(MemoryInstance&& a)
-		{
-			~MemoryInstance();
+		void forgetDentry(num_t parent, std::string_view name) {
+			std::unique_lock guard(dentries_->mutex, std::defer_lock);
+			if (concurrent_)
+				guard.lock();
+			auto& slot = dentries_->slots[DentryCache::slotOf(parent, name)];
+			if (slot.parent == parent && slot.name == name)
+				slot.name.clear();
+		}
 
-			if (&a != this)
-				data_ = transfer();
+		void clearDentries() {
+			std::unique_lock guard(dentries_->mutex, std::defer_lock);
+			if (concurrent_)
+				guard.lock();
+			for (auto& slot : dentries_->slots)
+				slot.name.clear();
 		}
 
-		~MemoryInstance()
-		{
-			if (data_ != nullptr)
-				free(data_);
+		static void markBit(std::vector<num_t>& bits, num_t index) {
+			std::atomic_ref<num_t> word(bits[index >> 6]);
+			num_t bit = 1ULL << (index & 63);
+			if (!(word.load(std::memory_order_relaxed) & bit))
+				word.fetch_or(bit, std::memory_order_relaxed);
 		}
 
-		num_t payload() {
-			num_t res{0};
-			for (num_t i = 0; i < SuperBlockCount; i++)
-				res += getSuperBlock(i).taken_amount;
-			return res;
+		void markBlockDirty(num_t global_index, bool metadata = false) {
+			markBit(dirty_blocks_, global_index);
+			if (cache_)
+				cacheDirty(blockOffset(global_index), BlockSize);
+			if (journal_) {
+				markBit(journal_->blocks, global_index);
+				if (metadata)
+					markBit(journal_->metadata, global_index);
+			}
 		}
 
-		struct FileReference {
-		private:
-			MemoryInstance* mem_inst;
-			num_t index;
+		void markSuperBlockDirty(num_t super_block) {
+			markBit(dirty_super_blocks_, super_block);
+			if (cache_)
+				cacheDirty(superBlockOffset(super_block), SuperBlockMetadataSize);
+			if (journal_)
+				markBit(journal_->super_blocks, super_block);
+		}
 
-			constexpr static const num_t Size0 = 1;
-			constexpr static const num_t Size1 = PtrBlockType::Size;
-			constexpr static const num_t Size2 = Size1 * PtrBlockType::Size;
-			constexpr static const num_t Size3 = Size2 * PtrBlockType::Size;
+		void markDescriptorDirty(num_t index) {
+			markBit(dirty_descriptors_, index * sizeof(Primitives::Descriptor) / DescriptorPageSize);
+			if (cache_)
+				cacheDirty(DescriptorsOffset + index * sizeof(Primitives::Descriptor), sizeof(Primitives::Descriptor));
+			if (journal_)
+				markBit(journal_->descriptors, index);
+		}
 
-			num_t allocateInPlace(PtrBlockType& block, int index) {
-				if (block.ptrs[index] == 0)
-					block.ptrs[index] = mem_inst->allocateSingleBlock<8>();
-				if (index < PtrBlockType::Size - 1)
-					block.ptrs[index + 1] = 0;
-				return block.ptrs[index];
+		void markAllocated(Primitives::Extent extent) {
+			for (num_t i = extent.start; i < extent.end(); i++)
+				markBlockDirty(i);
+			for (num_t sb = extent.start / SuperBlockSize; sb * SuperBlockSize < extent.end(); sb++)
+				markSuperBlockDirty(sb);
+		}
+
+		// Marks whatever part of the image holds address as changed.
+		void markDirty(const void* address, bool metadata = false) {
+			num_t offset = static_cast<const byte_t*>(address) - data_;
+			if (offset < DescriptorsOffset)
+				return;
+			if (offset < SuperBlocksOffset) {
+				markDescriptorDirty((offset - DescriptorsOffset) / sizeof(Primitives::Descriptor));
+				return;
 			}
+			if constexpr (SplitLayout) {
+				if (offset < BlocksOffset)
+					markSuperBlockDirty((offset - SuperBlocksOffset) / sizeof(SuperBlockType));
+				else
+					markBlockDirty((offset - BlocksOffset) / BlockSize, metadata);
+				return;
+			}
+			offset -= SuperBlocksOffset;
+			num_t sb = offset / sizeof(SuperBlockType);
+			num_t local = offset % sizeof(SuperBlockType);
+			if (local < SuperBlockMetadataSize)
+				markSuperBlockDirty(sb);
+			else
+				markBlockDirty(sb * SuperBlockSize + (local - SuperBlockMetadataSize) / BlockSize, metadata);
+		}
 
-			void allocateBlock(num_t index) {
-				auto& desc = descriptor().data;
+		// Image ranges of the set bits, one unit of size bytes per bit.
+		template<typename Offset>
+		static void collectRanges(std::vector<num_t>& bits, num_t size, std::vector<Primitives::Extent>& ranges, Offset&& offset) {
+			for (num_t w = 0; w < bits.size(); w++)
+				for (num_t word = bits[w]; word != 0; word &= word - 1)
+					ranges.push_back({ offset((w << 6) | std::countr_zero(word)), size });
+		}
 
-				if (index == 0)
-					if (desc.data_0_ptr == 0)
-						desc.data_0_ptr = mem_inst->allocateSingleBlock<8>();
+		static void coalesce(std::vector<Primitives::Extent>& ranges) {
+			std::sort(ranges.begin(), ranges.end(), [](const Primitives::Extent& a, const Primitives::Extent& b) { return a.start < b.start; });
+			num_t count = 0;
+			for (auto& range : ranges)
+				if (count != 0 && ranges[count - 1].end() >= range.start)
+					ranges[count - 1].length = std::max(ranges[count - 1].end(), range.end()) - ranges[count - 1].start;
+				else
+					ranges[count++] = range;
+			ranges.resize(count);
+		}
 
-				if (index < Size0)
-					return;
+		// The header plus every marked, still allocated range of the image.
+		std::vector<Primitives::Extent> dirtyRegions(std::vector<num_t>& blocks, std::vector<num_t>& descriptor_pages, std::vector<num_t>& super_blocks) {
+			std::vector<Primitives::Extent> regions{ { 0, sizeof(Primitives::Header) } };
+			collectRanges(descriptor_pages, DescriptorPageSize, regions, [](num_t page) { return DescriptorsOffset + page * DescriptorPageSize; });
+			if (DescriptorCount * sizeof(Primitives::Descriptor) % DescriptorPageSize != 0 && regions.size() > 1 && regions.back().end() > SuperBlocksOffset)
+				regions.back().length = SuperBlocksOffset - regions.back().start;
+			collectRanges(super_blocks, SuperBlockMetadataSize, regions, superBlockOffset);
+			// Free blocks carry nothing worth restoring.
+			for (num_t w = 0; w < blocks.size(); w++)
+				for (num_t word = blocks[w]; word != 0; word &= word - 1)
+					if (num_t block = (w << 6) | std::countr_zero(word); blockTaken(block))
+						regions.push_back({ blockOffset(block), BlockSize });
+			coalesce(regions);
+			if (cache_)
+				for (auto& region : regions)
+					cacheAccess(region.start, region.length, 0);
+			return regions;
+		}
 
-				index -= Size0;
-				if (index == 0)
-					if (desc.data_1_ptr == 0)
-						desc.data_1_ptr = mem_inst->allocateSingleBlock<8>();
-				if (index < Size1) {
-					auto& block = mem_inst->getPtrBlock(desc.data_1_ptr);
-					allocateInPlace(block, index);
-					return;
-				}
+		std::vector<Platform::AsyncIO::Request> requests(const std::vector<Primitives::Extent>& ranges) {
+			std::vector<Platform::AsyncIO::Request> res;
+			res.reserve(ranges.size());
+			for (auto& range : ranges)
+				res.push_back({ range.start, data_ + range.start, range.length });
+			return res;
+		}
 
-				index -= Size1;
-				if (index == 0)
-					if (desc.data_2_ptr == 0)
-						desc.data_2_ptr = mem_inst->allocateSingleBlock<8>();
+		std::vector<Platform::AsyncIO::Request> blockRequests(std::span<const num_t> blocks) {
+			if (!loaded())
+				throw new std::runtime_error("Instance is not loaded from an image");
+			if (cache_)
+				throw new std::runtime_error("Cached instances read blocks on access");
+			std::vector<Primitives::Extent> ranges;
+			for (num_t block : blocks)
+				ranges.push_back({ blockOffset(block), BlockSize });
+			coalesce(ranges);
+			return requests(ranges);
+		}
 
-				if (index < Size2)  {
-					auto& block1 = mem_inst->getPtrBlock(desc.data_2_ptr);
-					auto& block2 = mem_inst->getPtrBlock(allocateInPlace(block1, index / Size1));
-					allocateInPlace(block2, index % Size1);
-					return;
-				}
+		static num_t blockOffset(num_t global_index) {
+			if constexpr (SplitLayout)
+				return BlocksOffset + global_index * BlockSize;
+			else
+				return BlocksOffset + sizeof(SuperBlockType) * (global_index / SuperBlockSize) + global_index % SuperBlockSize * BlockSize;
+		}
 
-				index -= Size2;
-				if (index == 0)
-					if (desc.data_3_ptr == 0)
-						desc.data_3_ptr = mem_inst->allocateSingleBlock<8>();
+		static num_t superBlockOffset(num_t super_block) {
+			return SuperBlocksOffset + super_block * sizeof(SuperBlockType);
+		}
 
-				{
-					auto& block1 = mem_inst->getPtrBlock(desc.data_3_ptr);
-					auto& block2 = mem_inst->getPtrBlock(allocateInPlace(block1, index / Size2));
-					auto& block3 = mem_inst->getPtrBlock(allocateInPlace(block2, (index / Size1) % Size1));
-					allocateInPlace(block3, index % Size1);
+		// Makes the units under a range resident, reading a missing run in one
+		// go; a miss right where the previous one ended also reads ahead.
+		void cacheAccess(num_t offset, num_t length, byte_t weight) {
+			auto& cache = *cache_;
+			num_t last = (offset + length - 1) / cache.unit;
+			bool hit = true;
+			for (num_t unit = offset / cache.unit; unit <= last; unit++) {
+				if (cache.state[unit] == 0) {
+					hit = false;
+					num_t end = unit;
+					num_t limit = std::min(unit == cache.next_miss ? std::max(last, unit + CacheReadAhead - 1) : last, cache.units - 1);
+					while (end <= limit && cache.state[end] == 0)
+						end++;
+					num_t start = unit * cache.unit;
+					// Units past the end of the image read as zeros.
+					if (start < imageSize())
+						Platform::readFileAt(backing_, start, data_ + start, std::min(end * cache.unit, imageSize()) - start);
+					std::fill(cache.state.begin() + unit, cache.state.begin() + end, 1);
+					cache.resident += end - unit;
+					cache.next_miss = end;
 				}
+				cache.state[unit] = std::max<byte_t>(cache.state[unit], 1 + weight);
 			}
+			(hit ? cache.hits : cache.misses)++;
+		}
+
+		// A block may be marked before it is first touched, so the mark brings
+		// it in; otherwise a later load would hide the change.
+		void cacheDirty(num_t offset, num_t length) {
+			auto& cache = *cache_;
+			cacheAccess(offset, length, 0);
+			for (num_t unit = offset / cache.unit; unit <= (offset + length - 1) / cache.unit; unit++)
+				markBit(cache.dirty, unit);
+		}
 
-			bool freeInPlace(PtrBlockType& block, num_t index, num_t dp) {
-				num_t pow = CPower(PtrBlockType::Size, dp);
-				bool a = true;
-				if (dp > 0)
-					a = freeInPlace(mem_inst->getPtrBlock(block.ptrs[index / pow]), index % pow, dp - 1);
-				index /= pow;
-				if (a || dp == 0) {
-					mem_inst->freeSingleBlock(block.ptrs[index]);
-					block.ptrs[index] = 0;
+		// Keeps the units under a range resident for good, as superblock bitmaps
+		// are read without going through cacheAccess.
+		void cachePin(num_t offset, num_t length) {
+			auto& cache = *cache_;
+			cacheAccess(offset, length, 0);
+			for (num_t unit = offset / cache.unit; unit <= (offset + length - 1) / cache.unit; unit++)
+				if (!(cache.pinned[unit >> 6] & (1ULL << (unit & 63)))) {
+					cache.pinned[unit >> 6] |= 1ULL << (unit & 63);
+					cache.resident--;
+					cache.pinned_count++;
 				}
-				return index == 0 && a;
-			}
+		}
 
-			void freeBlock(num_t index) {
-				auto& desc = descriptor();
+		// Image ranges of the marked units, clipped to the image.
+		std::vector<Primitives::Extent> unitRanges(std::vector<num_t>& units) {
+			std::vector<Primitives::Extent> ranges;
+			num_t unit = cache_->unit;
+			collectRanges(units, unit, ranges, [unit](num_t index) { return index * unit; });
+			coalesce(ranges);
+			while (!ranges.empty() && ranges.back().start >= imageSize())
+				ranges.pop_back();
+			if (!ranges.empty() && ranges.back().end() > imageSize())
+				ranges.back().length = imageSize() - ranges.back().start;
+			return ranges;
+		}
 
-				if (index == 0) {
-					mem_inst->freeSingleBlock(desc.data.data_0_ptr);
-					desc.data.data_0_ptr = 0;
-					return;
+		// Runs at the start of every outermost operation and between the pieces
+		// of a large transfer, so no reference into an evicted unit is live.
+		// Evicts a sixteenth below capacity at a time, writing the changed
+		// victims back in one batch.
+		void trimCache() {
+			auto& cache = *cache_;
+			if (cache.resident <= cache.capacity)
+				return;
+			// A running flush still reads units whose dirty bits it has taken.
+			io_->drain();
+			std::vector<num_t> victims((cache.units + 63) / 64);
+			num_t target = cache.capacity - cache.capacity / 16;
+			num_t count = 0;
+			while (cache.resident - count > target) {
+				num_t unit = cache.hand;
+				cache.hand = (unit + 1) % cache.units;
+				if (cache.state[unit] == 0 || cache.pinned[unit >> 6] & (1ULL << (unit & 63)))
+					continue;
+				if (--cache.state[unit] == 0) {
+					victims[unit >> 6] |= 1ULL << (unit & 63);
+					count++;
 				}
+			}
+			std::vector<num_t> written(victims.size());
+			for (num_t w = 0; w < victims.size(); w++)
+				written[w] = victims[w] & cache.dirty[w];
+			try {
+				io_->submit(requests(unitRanges(written)), true).get();
+			}
+			catch (...) {
+				for (num_t w = 0; w < victims.size(); w++)
+					for (num_t word = victims[w]; word != 0; word &= word - 1)
+						cache.state[(w << 6) | std::countr_zero(word)] = 1;
+				throw;
+			}
+			for (num_t w = 0; w < victims.size(); w++) {
+				cache.dirty[w] &= ~victims[w];
+				cache.write_backs += std::popcount(written[w]);
+			}
+			for (auto& range : unitRanges(victims))
+				Platform::discardMemory(data_ + range.start, (range.length + cache.unit - 1) / cache.unit * cache.unit);
+			cache.resident -= count;
+			cache.evictions += count;
+		}
 
-				index -= Size0;
-				if (index < Size1) {
-					freeInPlace(mem_inst->getPtrBlock(desc.data.data_1_ptr), index, 0);
-					if (index == 0) {
-						mem_inst->freeSingleBlock(desc.data.data_1_ptr);
-						desc.data.data_1_ptr = 0;
-					}
-					return;
-				}
+		bool blockTaken(num_t global_index) {
+			return getSuperBlockByBlockIndex(global_index).isTaken(global_index % SuperBlockSize);
+		}
 
-				index -= Size1;
-				if (index < Size2) {
-					freeInPlace(mem_inst->getPtrBlock(desc.data.data_2_ptr), index, 1);
-					if (index == 0) {
-						mem_inst->freeSingleBlock(desc.data.data_2_ptr);
-						desc.data.data_2_ptr = 0;
-					}
-					return;
+		num_t getFreeBlock() {
+			for (num_t w = 0; w < FreeSummaryWords; w++)
+				if (free_summary_[w] != 0) {
+					num_t i = (w << 6) | std::countr_zero(free_summary_[w]);
+					return getSuperBlock(i).firstFreeIndex() + i * SuperBlockSize;
 				}
+			throw new std::bad_alloc();
+		}
 
-				index -= Size2;
-				if (index < Size3) {
-					freeInPlace(mem_inst->getPtrBlock(desc.data.data_3_ptr), index, 2);
-					if (index == 0) {
-						mem_inst->freeSingleBlock(desc.data.data_3_ptr);
-						desc.data.data_3_ptr = 0;
-					}
-					return;
-				}
+		// The summary bit is only written when clear, which keeps frees off the
+		// shared summary word. Frees lower taken_amount before reading the bit
+		// and markFullConcurrent clears the bit before reading taken_amount, all
+		// sequentially consistent, so one of the two always sees the other.
+		void markFreeConcurrent(num_t super_block) {
+			std::atomic_ref<num_t> word(free_summary_[super_block >> 6]);
+			if (!(word.load() & (1ULL << (super_block & 63))))
+				word.fetch_or(1ULL << (super_block & 63));
+		}
+
+		void markFullConcurrent(num_t super_block) {
+			std::atomic_ref<num_t>(free_summary_[super_block >> 6]).fetch_and(~(1ULL << (super_block & 63)));
+			if (getSuperBlock(super_block).takenConcurrent() < SuperBlockSize)
+				markFreeConcurrent(super_block);
+		}
 
-				throw new std::out_of_range("free unindexed block");
+		num_t nextFreeSuperBlockConcurrent(num_t super_block) {
+			for (num_t w = super_block >> 6; w < FreeSummaryWords; w++) {
+				num_t word = std::atomic_ref<num_t>(free_summary_[w]).load(std::memory_order_acquire);
+				if (w == super_block >> 6)
+					word &= ~0ULL << (super_block & 63);
+				if (word != 0)
+					return (w << 6) | std::countr_zero(word);
 			}
+			return SuperBlockCount;
+		}
 
-			void allocate(num_t amount) {
-				auto block_max = BlockCount;
-				auto& desc = descriptor();
-				while (amount-- > 0) {
-					num_t allocated_blocks = (desc.header.size + BlockSize - 1) / BlockSize;
-					allocateBlock(allocated_blocks);
-					desc.header.size += BlockSize;
+		// Claims up to max consecutive blocks, starting from the calling thread's
+		// shard and moving on to other superblocks only when it is exhausted.
+		Primitives::Extent claimConcurrent(num_t max) {
+			if (alloc_shard_ == AllocationShards)
+				alloc_shard_ = shard_counter_.fetch_add(1, std::memory_order_relaxed) % AllocationShards;
+			std::atomic_ref<num_t> hint(alloc_hints_[alloc_shard_]);
+			num_t home = hint.load(std::memory_order_relaxed);
+			if (home >= super_block_count_)
+				home = alloc_shard_ * ShardStride % super_block_count_;
+
+			num_t sb = home;
+			for (num_t visited = 0; visited <= SuperBlockCount; visited++) {
+				sb = nextFreeSuperBlockConcurrent(sb);
+				if (sb == SuperBlockCount && (sb = nextFreeSuperBlockConcurrent(0)) == SuperBlockCount)
+					break;
+				auto& super_block = getSuperBlock(sb);
+				num_t first;
+				num_t run = super_block.allocConcurrent(max, first);
+				if (run != 0) {
+					if (sb != home)
+						hint.store(sb, std::memory_order_relaxed);
+					if (super_block.takenConcurrent() >= SuperBlockSize)
+						markFullConcurrent(sb);
+					return { sb * SuperBlockSize + first, run };
 				}
+				markFullConcurrent(sb);
+				sb = (sb + 1) % SuperBlockCount;
 			}
+			throw new std::bad_alloc();
+		}
 
-			void deallocate(num_t amount) {
-				auto block_max = BlockCount;
-				auto& desc = descriptor();
-				while (amount-- > 0) {
-					num_t allocated_blocks = (desc.header.size + BlockSize - 1) / BlockSize;
-					freeBlock(allocated_blocks - 1);
-					desc.header.size -= BlockSize;
-				}
+		template<num_t EmptifyAmount = 0>
+		num_t allocateSingleBlock() {
+			if (concurrent_) {
+				num_t free = claimConcurrent(1).start;
+				markAllocated({ free, 1 });
+				emptify<EmptifyAmount>({ free, 1 });
+				return free;
 			}
 
-			FileReference() = default;
+			num_t free = getFreeBlock();
+			SuperBlockType& sb = getSuperBlockByBlockIndex(free);
+			sb.allocBlock(free % SuperBlockSize);
+			if (sb.taken_amount == SuperBlockSize)
+				updateFreeSummary(free / SuperBlockSize);
+			markAllocated({ free, 1 });
+			emptify<EmptifyAmount>({ free, 1 });
+			return free;
+		}
 
-		public:
-			
-			Primitives::Descriptor& descriptor() {
-				return mem_inst->getDescriptor(index);
+		// Clears the first EmptifyAmount bytes of each block of a just allocated
+		// extent, skipping blocks still known to be zero, and records that the
+		// extent is in use. Must be called for every allocation, even with
+		// nothing to clear.
+		template<num_t EmptifyAmount>
+		void emptify(Primitives::Extent extent) {
+			while (extent.length > 0) {
+				num_t sb = extent.start / SuperBlockSize;
+				num_t local = extent.start % SuperBlockSize;
+				num_t count = std::min(extent.length, SuperBlockSize - local);
+				num_t fresh = SuperBlockSize;
+				if (!fresh_from_.empty()) {
+					std::atomic_ref<num_t> mark(fresh_from_[sb]);
+					fresh = mark.load();
+					while (fresh < local + count && !mark.compare_exchange_weak(fresh, local + count));
+				}
+				if constexpr (EmptifyAmount > 0)
+					for (num_t i = local; i < std::min(local + count, std::max(fresh, local)); i++)
+						std::memset(getBlock(sb * SuperBlockSize + i).data.data(), 0, EmptifyAmount);
+				extent.start += count;
+				extent.length -= count;
 			}
+		}
 
-			bool exsits() {
-				return descriptor().attributes.flags && descriptor().attributes.EX;
+		void freeSingleBlock(num_t block) {
+			SuperBlockType& sb = getSuperBlockByBlockIndex(block);
+			markSuperBlockDirty(block / SuperBlockSize);
+			if (sb.dropShare(block % SuperBlockSize))
+				return;
+			if (concurrent_) {
+				releaseBlocks(block / SuperBlockSize, block % SuperBlockSize, 1);
+				return;
 			}
+			sb.freeBlock(block % SuperBlockSize);
+			free_summary_[block / SuperBlockSize >> 6] |= 1ULL << (block / SuperBlockSize & 63);
+			noteFreed(block, 1);
+		}
 
-			void setName(std::string name, bool except_on_oversize = true);
-
-			void deletFile() {
-				descriptor().attributes.flags &= !descriptor().attributes.EX;
-
-				num_t allocated_blocks = (descriptor().header.size + BlockSize - 1) / BlockSize;
-				deallocate(allocated_blocks);
+		num_t nextFreeBlock(num_t global_index) {
+			while (global_index < BlockCount) {
+				num_t sb = global_index / SuperBlockSize;
+				num_t word = free_summary_[sb >> 6] & (~0ULL << (sb & 63));
+				if (word == 0) {
+					global_index = ((sb >> 6) + 1) * 64 * SuperBlockSize;
+					continue;
+				}
+				num_t next = (sb & ~num_t(63)) | std::countr_zero(word);
+				if (next != sb)
+					global_index = next * SuperBlockSize;
+				num_t local = getSuperBlock(next).nextFreeIndex(global_index % SuperBlockSize);
+				if (local < SuperBlockSize)
+					return next * SuperBlockSize + local;
+				global_index = (next + 1) * SuperBlockSize;
 			}
-			void createFile() {
-				if (exsits())
-					throw new std::bad_alloc();
+			return BlockCount;
+		}
 
-				descriptor().attributes.flags |= descriptor().attributes.EX;
-				descriptor().initEmpty();
-			}
-			void resizeFile(num_t new_size) {
-				auto& desc = descriptor();
-				num_t allocated_blocks = (desc.header.size + BlockSize - 1) / BlockSize;
-				num_t required_block = (new_size + BlockSize - 1) / BlockSize;
-				if (required_block > allocated_blocks)
-					allocate(required_block - allocated_blocks);
-				if (required_block < allocated_blocks)
-					deallocate(allocated_blocks - required_block);
-			}
-			BlockType& getBlock(num_t index) {
-				return mem_inst->getBlock(mem_inst->getIndexedPtr(this->index, index));
-			}
-			num_t getAllocatedBlockCount() {
-				return (descriptor().header.size + BlockSize - 1) / BlockSize;
+		num_t freeRunLength(num_t global_index, num_t max) {
+			num_t res = 0;
+			while (res < max && global_index + res < super_block_count_ * SuperBlockSize) {
+				num_t local = (global_index + res) % SuperBlockSize;
+				num_t limit = std::min(max - res, SuperBlockSize - local);
+				num_t run = getSuperBlockByBlockIndex(global_index + res).freeRunLength(local, limit);
+				res += run;
+				if (run < limit)
+					break;
 			}
+			return res;
+		}
 
-			MemoryInstance* instance() {
-				return mem_inst;
+		void markRange(Primitives::Extent extent, bool taken) {
+			while (extent.length > 0) {
+				num_t sb = extent.start / SuperBlockSize;
+				num_t local = extent.start % SuperBlockSize;
+				num_t count = std::min(extent.length, SuperBlockSize - local);
+				markSuperBlockDirty(sb);
+				if (taken)
+					getSuperBlock(sb).allocRange(local, count);
+				else
+					getSuperBlock(sb).freeRange(local, count);
+				updateFreeSummary(sb);
+				extent.start += count;
+				extent.length -= count;
 			}
+		}
 
-			static FileReference fileAt(num_t index, MemoryInstance* src) {
-				FileReference res{};
-				res.index = index;
-				res.mem_inst = src;
+		template<num_t EmptifyAmount = 0>
+		std::vector<Primitives::Extent> allocateRange(num_t count) {
+			std::vector<Primitives::Extent> res;
+			if (count == 0)
 				return res;
-			}
-
-			template<typename Type>
-			struct DataIterator {
-			private:
-				FileReference* ref_ptr_;
-				num_t index_;
-				num_t offest_;
-
-			public:
-				DataIterator(FileReference* file, num_t index = 0, num_t byte_offest = 0) : ref_ptr_(file), index_(index), offest_(byte_offest) {}
-
-				void set(const Type& a) {
-					const auto& data = reinterpret_cast<const std::array<byte_t, sizeof(Type)>&>(a);
-					num_t size = sizeof(Type);
-					num_t index = 0;
-					num_t offest = offest_ + index_ * sizeof(Type);
-					num_t bindex = offest % BlockSize;
-
-					BlockType* block;
 
-					while (index < size) {
-						block = getBlock((offest + index) / BlockSize);
-						for (; bindex < BlockSize && index < size; bindex++, index++)
-							block.data[bindex] = data[index];
-						bindex = 0;
+			if (concurrent_) {
+				try {
+					while (count > 0) {
+						auto extent = claimConcurrent(count);
+						if (!res.empty() && res.back().end() == extent.start)
+							res.back().length += extent.length;
+						else
+							res.push_back(extent);
+						count -= extent.length;
 					}
 				}
-
-				Type operator*() {
-					std::array<byte_t, sizeof(Type)> data;
-					num_t size = sizeof(Type);
-					num_t index = 0;
-					num_t offest = offest_ + index_ * sizeof(Type);
-					num_t bindex = offest % BlockSize;
-
-					BlockType* block;
-
-					while (index < size) {
-						block = getBlock((offest + index) / BlockSize);
-						for (; bindex < BlockSize && index < size; bindex++, index++)
-							data[index] = block.data[bindex];
-						bindex = 0;
-					}
-
-					return reinterpret_cast<Type>(data);
+				catch (std::bad_alloc*) {
+					for (auto& extent : res)
+						freeRange(extent);
+					throw;
 				}
-
-				DataIterator& operator++() {
-					index_++;
-					return *this;
+				for (auto& extent : res) {
+					markAllocated(extent);
+					emptify<EmptifyAmount>(extent);
 				}
+				return res;
+			}
 
-				bool operator!=(const DataIterator& other) {
-					return index_ * sizeof(Type) + offest_ != other.index_ * sizeof(Type) + other.offest_;
+			num_t start = nextFreeBlock(0);
+			num_t first = start;
+			while (start < BlockCount) {
+				num_t run = freeRunLength(start, count);
+				if (run == count)
+					break;
+				start = nextFreeBlock(start + run);
+			}
+			if (start < BlockCount)
+				res.push_back({ start, count });
+			else
+				for (start = first; count > 0 && start < BlockCount; start = nextFreeBlock(start)) {
+					num_t run = freeRunLength(start, count);
+					res.push_back({ start, run });
+					count -= run;
+					start += run;
 				}
-			};
-		};
 
-		struct API;
-	};
+			if (start >= BlockCount && count > 0)
+				throw new std::bad_alloc();
 
-	template<num_t BlockSize, num_t SuperBlockSize, num_t SuperBlockCount, num_t DescriptorCount>
-	struct MemoryInstance<BlockSize, SuperBlockSize, SuperBlockCount, DescriptorCount>::API {
-		static std::vector<FileReference> ListFiles(MemoryInstance* inst) {
-			std::vector<FileReference> res;
-			for (num_t i = 0; i < DescriptorCount; i++) {
-				auto& desc = inst->getDescriptor(i);
-				if (desc.attributes.flags & desc.attributes.EX)
-					res.push_back(FileReference::fileAt(i, inst));
+			for (auto& extent : res) {
+				markRange(extent, true);
+				markAllocated(extent);
+				emptify<EmptifyAmount>(extent);
 			}
 			return res;
 		}
-		static std::vector<FileReference> OpenDirectory(FileReference ref) {
-			auto& desc = ref.descriptor();
-			if (!(desc.attributes.flags & desc.attributes.DR))
-				return {};
 
-			std::vector<FileReference> files;
+		void releaseBlocks(num_t sb, num_t local, num_t count) {
+			if (count == 0)
+				return;
+			markSuperBlockDirty(sb);
+			if (concurrent_) {
+				getSuperBlock(sb).freeRangeConcurrent(local, count);
+				markFreeConcurrent(sb);
+			}
+			else {
+				getSuperBlock(sb).freeRange(local, count);
+				updateFreeSummary(sb);
+			}
+			noteFreed(sb * SuperBlockSize + local, count);
+		}
+
+		void noteFreed(num_t start, num_t count) {
+			if (freed_blocks_.empty())
+				return;
+			for (num_t i = start; i < start + count; i++)
+				markBit(freed_blocks_, i);
+			std::atomic_ref<num_t>(freed_count_).fetch_add(count, std::memory_order_relaxed);
+			if (guard_depth_ == 0 && !concurrent_ && !journal_)
+				reclaimIfDue();
+		}
+
+		void reclaimIfDue() {
+			if (!freed_blocks_.empty() && std::atomic_ref<num_t>(freed_count_).load(std::memory_order_relaxed) * BlockSize >= ReclaimBatch)
+				reclaim();
+		}
+
+		// The block holding an image offset, BlockCount outside the block area.
+		static num_t blockAt(num_t offset) {
+			if (offset < BlocksOffset || offset >= TotalSize)
+				return BlockCount;
+			if constexpr (SplitLayout)
+				return (offset - BlocksOffset) / BlockSize;
+			num_t local = (offset - BlocksOffset) % sizeof(SuperBlockType);
+			if (local >= SuperBlockSize * BlockSize)
+				return BlockCount;
+			return (offset - BlocksOffset) / sizeof(SuperBlockType) * SuperBlockSize + local / BlockSize;
+		}
+
+		// Whether the granule at offset holds free blocks only.
+		bool granuleFree(num_t offset) {
+			num_t first = blockAt(offset);
+			num_t last = blockAt(offset + reclaim_granule_ - 1);
+			if (first == BlockCount || last == BlockCount || (!SplitLayout && first / SuperBlockSize != last / SuperBlockSize))
+				return false;
+			return freeRunLength(first, last - first + 1) == last - first + 1;
+		}
 
-			for (num_t i = 0; i < ref.getAllocatedBlockCount(); i++) {
-				BlockType& block = ref.getBlock(i);
-				PtrBlockType& pb = reinterpret_cast<PtrBlockType&>(block);
-				for (num_t i = 0; i < pb.Size && pb.ptrs[i] != 0; i++)
-					files.push_back(FileReference::fileAt(pb.ptrs[i], ref.instance()));
+		// Blocks that are still shared with a clone only lose an owner.
+		void freeRange(Primitives::Extent extent) {
+			while (extent.length > 0) {
+				num_t sb = extent.start / SuperBlockSize;
+				num_t local = extent.start % SuperBlockSize;
+				num_t count = std::min(extent.length, SuperBlockSize - local);
+				auto& super_block = getSuperBlock(sb);
+				markSuperBlockDirty(sb);
+				for (num_t i = local, end = local + count; i < end;) {
+					num_t shared = super_block.nextShared(i, end);
+					releaseBlocks(sb, i, shared - i);
+					if (shared < end && !super_block.dropShare(shared))
+						releaseBlocks(sb, shared, 1);
+					i = shared + 1;
+				}
+				extent.start += count;
+				extent.length -= count;
 			}
+		}
+
+		bool blockShared(num_t block) {
+			return getSuperBlockByBlockIndex(block).shared(block % SuperBlockSize);
+		}
 
-			return files;
+		void shareBlock(num_t block) {
+			markSuperBlockDirty(block / SuperBlockSize);
+			getSuperBlockByBlockIndex(block).share(block % SuperBlockSize);
+		}
+
+		bool dropShare(num_t block) {
+			markSuperBlockDirty(block / SuperBlockSize);
+			return getSuperBlockByBlockIndex(block).dropShare(block % SuperBlockSize);
+		}
+
+		void shareRange(Primitives::Extent extent) {
+			for (num_t i = extent.start; i < extent.end(); i++)
+				shareBlock(i);
+		}
+
+		// Switches block allocation to atomic bitmap updates so allocateSingleBlock,
+		// allocateRange and their frees may be called from several threads, and
+		// makes FileReference operations take per-file locks. Each allocation and
+		// free costs a few atomic operations, about what a mutex around the serial
+		// path costs, so a single thread gains nothing from it. Must not be
+		// toggled while operations are in flight.
+		void setConcurrent(bool enable) {
+			if (enable && (SuperBlocksOffset + sizeof(SuperBlockType)) % sizeof(num_t) != 0)
+				throw new std::invalid_argument("Concurrent mode requires word aligned superblocks");
+			if (enable && cache_)
+				throw new std::invalid_argument("Cached instances do not support concurrent mode");
+			if (enable && !file_locks_) {
+				file_locks_ = std::make_unique<array_type<FileLock, LockStripes>>();
+				heap_mutex_ = std::make_unique<std::mutex>();
+			}
+			if (enable)
+				alloc_hints_.fill(SuperBlockCount);
+			concurrent_ = enable;
+			if (!enable)
+				rebuildFreeSummary();
+		}
+
+		bool concurrent() const {
+			return concurrent_;
+		}
+
+		// Hands the memory behind free blocks back to the system so the resident
+		// size follows payload(). Pages, or huge pages for instances backed by
+		// them, whose blocks are all free are discarded, and a mapped image gets
+		// a hole punched there. Frees are only recorded; a pass over them runs
+		// once ReclaimBatch bytes of blocks were freed, after the operation that
+		// crossed it or, for journaled instances, after the next commit. In
+		// concurrent mode without a journal only an explicit reclaim runs one.
+		// Enabling reclaims every block that is free already.
+		void setReclaim(bool enable) {
+			freed_blocks_.assign(enable ? (BlockCount + 63) / 64 : 0, 0);
+			freed_count_ = 0;
+			if (!enable)
+				return;
+			reclaim_granule_ = memory_policy_.pages != Platform::MemoryPolicy::Default ? Platform::HugePageSize : Platform::pageSize();
+			for (num_t i = 0; i < super_block_count_ * SuperBlockSize; i++)
+				if (!blockTaken(i))
+					markBit(freed_blocks_, i);
+			reclaim();
+		}
+
+		// Empties the instance in place as if it was just created. The blocks
+		// keep their bytes until reused. No operations may be in flight, and
+		// journaled and cached instances cannot be reformatted.
+		void reformat() {
+			if (journal_ || cache_)
+				throw new std::runtime_error("Journaled and cached instances cannot be reformatted");
+			format(false);
+			indexFormatted();
+			clearDentries();
+			for (num_t i = 0; i < DescriptorPages; i++)
+				markBit(dirty_descriptors_, i);
+			for (num_t i = 0; i < super_block_count_; i++)
+				markBit(dirty_super_blocks_, i);
+			if (reclaiming())
+				setReclaim(true);
+		}
+
+		bool reclaiming() const {
+			return !freed_blocks_.empty();
+		}
+
+		// Runs a reclaim pass now; no operations may be in flight.
+		void reclaim() {
+			if (freed_blocks_.empty())
+				return;
+			// Granules are aligned in memory, which for a mapped image is also
+			// alignment in the file; adjacent ones go out as one range.
+			num_t base = (num_t)data_ % reclaim_granule_;
+			Primitives::Extent run{ 0, 0 };
+			auto discard = [this, base](Primitives::Extent range) {
+				if (range.length == 0)
+					return;
+				if (mapped())
+					Platform::punchHole(mapping_, range.start - base, range.length);
+				Platform::discardMemory(data_ + range.start - base, range.length);
+			};
+			num_t next = 0;
+			for (num_t w = 0; w < freed_blocks_.size(); w++) {
+				for (num_t word = std::exchange(freed_blocks_[w], 0); word != 0; word &= word - 1) {
+					num_t offset = blockOffset((w << 6) | std::countr_zero(word));
+					num_t start = std::max(next, (offset + base) / reclaim_granule_ * reclaim_granule_);
+					for (; start < offset + BlockSize + base; start += reclaim_granule_) {
+						if (start < base || !granuleFree(start - base))
+							continue;
+						if (run.end() != start) {
+							discard(run);
+							run = { start, 0 };
+						}
+						run.length += reclaim_granule_;
+					}
+					next = start;
+				}
+			}
+			discard(run);
+			freed_count_ = 0;
+		}
+
+		byte_t* transfer()
+		{
+			auto tmp = data_;
+			data_ = nullptr;
+			return tmp;
+		}
+
+	private:
+		// Memory fresh from the system is zero, which is already the empty state
+		// of every superblock and descriptor, so only the header and the reserved
+		// block 0 are written then, and data blocks are not cleared on first
+		// allocation. Otherwise the metadata is cleared on several threads.
+		void format(bool zeroed = true) {
+			auto& header = getHeader();
+			header.magic = Primitives::Header::Magic;
+			header.block_size = BlockSize;
+			header.super_block_size = SuperBlockSize;
+			header.descriptors_count = descriptor_count_;
+			header.super_block_count = super_block_count_;
+			header.root_descriptor = 0;
+			header.heap_descriptor = 0;
+			header.checkpoint_sequence = 0;
+			header.blocks_offset = BlocksOffset;
+			header.user_data.fill(0);
+
+			if (!zeroed) {
+				std::memset(data_ + blockOffset(0), 0, BlockSize);
+				parallelFor(super_block_count_, [this](num_t first, num_t end) {
+					if constexpr (SplitLayout)
+						std::memset(data_ + superBlockOffset(first), 0, (end - first) * SuperBlockMetadataSize);
+					else
+						for (num_t i = first; i < end; i++)
+							getSuperBlock(i).initEmpty();
+				});
+				parallelFor(descriptor_count_, [this](num_t first, num_t end) {
+					std::memset(data_ + DescriptorsOffset + first * sizeof(Primitives::Descriptor), 0, (end - first) * sizeof(Primitives::Descriptor));
+				});
+				fresh_from_.clear();
+			}
+			else {
+				fresh_from_.assign(SuperBlockCount, 0);
+				fresh_from_[0] = 1;
+			}
+			getSuperBlock(0).allocBlock(0);
+		}
+
+		// Free summary and descriptor index of a just formatted instance, which
+		// need no scan: every superblock has free blocks and no descriptor is live.
+		void indexFormatted() {
+			free_summary_.fill(0);
+			for (num_t i = 0; i < super_block_count_; i++)
+				free_summary_[i >> 6] |= 1ULL << (i & 63);
+			live_descriptors_.assign(DescriptorWords, 0);
+			descriptor_hint_ = 0;
+			file_count_ = 0;
+		}
+
+		void setCounts(num_t super_blocks, num_t descriptors) {
+			if (super_blocks == 0 || super_blocks > SuperBlockCount || descriptors == 0 || descriptors > DescriptorCount)
+				throw new std::invalid_argument("Geometry exceeds instance capacity");
+			super_block_count_ = super_blocks;
+			descriptor_count_ = descriptors;
+		}
+
+		// Extends the image file to the new counts and records them. The added
+		// superblocks and descriptors are cleared and marked changed when the
+		// bytes behind them are not zeros. Past the old end of the file, or of
+		// the counts for an instance without one, they are, and those pages
+		// are left untouched: faulting them in would dominate the grow.
+		void growTo(num_t super_blocks, num_t descriptors) {
+			num_t first = super_block_count_;
+			num_t first_descriptor = descriptor_count_;
+			num_t stale_end = mapped() ? mapping_.size : loaded() ? Platform::fileSize(backing_) : imageSize();
+			num_t size = imageSize(super_blocks);
+			if (super_blocks <= SuperBlockCount && size > imageSize()) {
+				if (mapped())
+					Platform::growMapping(mapping_, size);
+				else if (loaded() && Platform::fileSize(backing_) < size)
+					Platform::truncateFile(backing_, size);
+			}
+			setCounts(super_blocks, descriptors);
+			for (num_t i = first; i < super_blocks; i++) {
+				if (cache_)
+					cachePin(superBlockOffset(i), SuperBlockMetadataSize);
+				if (superBlockOffset(i) < stale_end && !zeros(data_ + superBlockOffset(i), SuperBlockMetadataSize)) {
+					getSuperBlock(i).initEmpty();
+					markSuperBlockDirty(i);
+				}
+				free_summary_[i >> 6] |= 1ULL << (i & 63);
+			}
+			for (num_t i = first_descriptor; i < descriptors; i++)
+				if (byte_t* desc = data_ + DescriptorsOffset + i * sizeof(Primitives::Descriptor); !zeros(desc, sizeof(Primitives::Descriptor))) {
+					std::memset(desc, 0, sizeof(Primitives::Descriptor));
+					markDescriptorDirty(i);
+				}
+			auto& header = getHeader();
+			header.super_block_count = super_blocks;
+			header.descriptors_count = descriptors;
+		}
+
+		static bool zeros(const byte_t* data, num_t size) {
+			return std::all_of(data, data + size, [](byte_t b) { return b == 0; });
+		}
+
+		// Runs body(first, end) over [0, count) in contiguous chunks of at least
+		// FormatGrain items, one chunk per hardware thread.
+		template<typename Body>
+		static void parallelFor(num_t count, Body body) {
+			num_t threads = std::clamp<num_t>(std::thread::hardware_concurrency(), 1, std::max<num_t>(count / FormatGrain, 1));
+			std::vector<std::thread> workers;
+			for (num_t t = 1; t < threads; t++)
+				workers.emplace_back(body, count * t / threads, count * (t + 1) / threads);
+			body(0, count / threads);
+			for (auto& worker : workers)
+				worker.join();
+		}
+
+		// Checks the header against the template and, when it fits, takes the
+		// counts in use from it.
+		bool validate(num_t size) {
+			auto& header = getHeader();
+			bool res = header.magic == Primitives::Header::Magic
+				&& header.block_size == BlockSize
+				&& header.super_block_size == SuperBlockSize
+				&& header.descriptors_count != 0 && header.descriptors_count <= DescriptorCount
+				&& header.super_block_count != 0 && header.super_block_count <= SuperBlockCount
+				&& header.blocks_offset == BlocksOffset
+				&& size >= imageSize(header.super_block_count);
+			if (res) {
+				super_block_count_ = header.super_block_count;
+				descriptor_count_ = header.descriptors_count;
+			}
+			return res;
+		}
+
+		// Bytes of image the first super_blocks superblocks take up.
+		static num_t imageSize(num_t super_blocks) {
+			if constexpr (SplitLayout)
+				return BlocksOffset + super_blocks * SuperBlockSize * BlockSize;
+			else
+				return SuperBlocksOffset + super_blocks * sizeof(SuperBlockType);
+		}
+
+		// Writes one log record with the header, descriptors, superblock bitmaps
+		// and metadata blocks changed since the last commit. Only once it is
+		// durable do they and the changed file blocks go to the image, so a block
+		// freed by the commit may be reused without harm.
+		void commitLocked() {
+			auto& journal = *journal_;
+			journal.pending.store(0, std::memory_order_relaxed);
+			std::vector<Primitives::Extent> data;
+			std::vector<Primitives::Extent> metadata{ { 0, sizeof(Primitives::Header) } };
+			collectRanges(journal.descriptors, sizeof(Primitives::Descriptor), metadata, [](num_t index) { return DescriptorsOffset + index * sizeof(Primitives::Descriptor); });
+			collectRanges(journal.super_blocks, SuperBlockMetadataSize, metadata, superBlockOffset);
+			for (num_t w = 0; w < journal.blocks.size(); w++)
+				for (num_t word = journal.blocks[w]; word != 0; word &= word - 1)
+					if (num_t block = (w << 6) | std::countr_zero(word); blockTaken(block)) {
+						bool logged = (journal.metadata[w] | journal.logged[w]) & (1ULL << (block & 63));
+						(logged ? metadata : data).push_back({ blockOffset(block), BlockSize });
+					}
+			for (num_t w = 0; w < journal.blocks.size(); w++)
+				journal.logged[w] |= journal.blocks[w] & journal.metadata[w];
+			coalesce(data);
+			coalesce(metadata);
+
+			Primitives::JournalRecord record{ Primitives::JournalRecord::Magic, journal.sequence, metadata.size(), metadata.size() * sizeof(Primitives::Extent), 0 };
+			for (auto& range : metadata)
+				record.size += range.length;
+			std::vector<byte_t> buffer(sizeof(record) + record.size);
+			byte_t* out = buffer.data() + sizeof(record);
+			std::memcpy(out, metadata.data(), metadata.size() * sizeof(Primitives::Extent));
+			out += metadata.size() * sizeof(Primitives::Extent);
+			for (auto& range : metadata) {
+				std::memcpy(out, data_ + range.start, range.length);
+				out += range.length;
+			}
+			record.checksum = checksum(buffer.data() + sizeof(record), record.size);
+			std::memcpy(buffer.data(), &record, sizeof(record));
+			try {
+				Platform::writeFileAt(journal.log, journal.log_size, buffer.data(), buffer.size());
+				Platform::syncFile(journal.log);
+			}
+			catch (...) {
+				Platform::truncateFile(journal.log, journal.log_size);
+				throw;
+			}
+			journal.log_size += buffer.size();
+			journal.sequence++;
+
+			// Waits for the image writes so a crash never leaves a committed block
+			// holding contents from after the commit.
+			Platform::FileHandle image{ mapping_.file };
+			data.insert(data.end(), metadata.begin(), metadata.end());
+			io_->submit(requests(data), true).get();
+			for (auto* bits : { &journal.blocks, &journal.metadata, &journal.descriptors, &journal.super_blocks })
+				std::fill(bits->begin(), bits->end(), 0);
+			if (journal.log_size >= JournalLimit) {
+				Platform::syncFile(image);
+				Platform::truncateFile(journal.log, 0);
+				journal.log_size = 0;
+				std::fill(journal.logged.begin(), journal.logged.end(), 0);
+			}
+			reclaimIfDue();
+		}
+
+		// Called by the outermost write guard of an operation.
+		Journal* enterJournal() {
+			auto& journal = *journal_;
+			if (journal.commit_interval != 0 && journal.pending.load(std::memory_order_relaxed) >= journal.commit_interval) {
+				std::unique_lock gate(journal.gate);
+				if (journal.pending.load(std::memory_order_relaxed) >= journal.commit_interval)
+					commitLocked();
+			}
+			journal.gate.lock_shared();
+			return &journal;
+		}
+
+		// Copies every intact record of the log into the image, makes it durable
+		// and empties the log; a torn or corrupt record ends the replay. Returns
+		// the sequence the next record takes.
+		static num_t replayJournal(const char* path, const char* log_path) {
+			auto image = Platform::openFile(path, false);
+			auto log = Platform::openFile(log_path, true, true);
+			num_t sequence = 0;
+			try {
+				num_t size = Platform::fileSize(log);
+				for (num_t pos = 0; size - pos >= sizeof(Primitives::JournalRecord);) {
+					Primitives::JournalRecord record;
+					Platform::readFile(log, &record, sizeof(record));
+					if (record.magic != Primitives::JournalRecord::Magic
+						|| (pos != 0 && record.sequence != sequence)
+						|| record.size > size - pos - sizeof(record)
+						|| record.region_count > record.size / sizeof(Primitives::Extent))
+						break;
+					std::vector<byte_t> body(record.size);
+					Platform::readFile(log, body.data(), body.size());
+					if (checksum(body.data(), body.size()) != record.checksum)
+						break;
+
+					std::vector<Primitives::Extent> regions(record.region_count);
+					std::memcpy(regions.data(), body.data(), regions.size() * sizeof(Primitives::Extent));
+					num_t total = regions.size() * sizeof(Primitives::Extent);
+					for (auto& region : regions)
+						if (region.start > TotalSize || region.length > TotalSize - region.start || (total += region.length) > body.size())
+							throw new std::invalid_argument("Corrupt journal");
+					const byte_t* in = body.data() + regions.size() * sizeof(Primitives::Extent);
+					for (auto& region : regions) {
+						Platform::writeFileAt(image, region.start, in, region.length);
+						in += region.length;
+					}
+					pos += sizeof(record) + record.size;
+					sequence = record.sequence + 1;
+				}
+				Platform::syncFile(image);
+				Platform::truncateFile(log, 0);
+				Platform::syncFile(log);
+			}
+			catch (...) {
+				Platform::closeFile(image);
+				Platform::closeFile(log);
+				throw;
+			}
+			Platform::closeFile(image);
+			Platform::closeFile(log);
+			return sequence;
+		}
+
+		void closeJournal() {
+			try {
+				commit();
+			}
+			catch (std::exception* e) {
+				delete e;
+			}
+			Platform::closeFile(journal_->log);
+			journal_.reset();
+		}
+
+		void release() {
+			if (journal_)
+				closeJournal();
+			io_.reset();
+			Platform::closeFile(backing_);
+			if (mapping_.data != nullptr)
+				Platform::unmapFile(mapping_);
+			else if (cache_)
+				Platform::releaseMemory(data_, cache_->units * cache_->unit);
+			else if (data_ != nullptr)
+				Platform::freeMemory(data_, TotalSize);
+			data_ = nullptr;
+		}
+
+		MemoryInstance(Platform::MappedFile mapping) : data_(mapping.data), mapping_(mapping) {}
+
+		// Image offset where the run of superblock sb starts.
+		static num_t superBlockRunOffset(num_t super_block) {
+			if constexpr (SplitLayout)
+				return blockOffset(super_block * SuperBlockSize);
+			else
+				return superBlockOffset(super_block);
+		}
+
+	public:
+		MemoryInstance() : MemoryInstance(Platform::MemoryPolicy{}) {}
+
+		// Starts with super_blocks superblocks and descriptors descriptors in use;
+		// grow adds more up to the template sizes. The whole capacity is reserved
+		// up front but only backed once used.
+		explicit MemoryInstance(Platform::MemoryPolicy policy, num_t super_blocks = SuperBlockCount, num_t descriptors = DescriptorCount) : memory_policy_(policy)
+		{
+			setCounts(super_blocks, descriptors);
+			data_ = Platform::allocateMemory(TotalSize, DataAlignment, policy);
+			if (policy.placement == Platform::MemoryPolicy::Bind) {
+				num_t mask = policy.node_mask != 0 ? policy.node_mask : Platform::memoryNodes();
+				num_t nodes = std::popcount(mask);
+				for (num_t k = 0; mask != 0; k++, mask &= mask - 1) {
+					num_t start = k == 0 ? 0 : superBlockRunOffset(SuperBlockCount * k / nodes);
+					num_t end = superBlockRunOffset(SuperBlockCount * (k + 1) / nodes);
+					Platform::placeMemory(data_ + start, end - start, 1ULL << std::countr_zero(mask), true);
+				}
+			}
+			format();
+			indexFormatted();
+		}
+
+		static MemoryInstance createImage(const char* path, num_t super_blocks = SuperBlockCount, num_t descriptors = DescriptorCount) {
+			MemoryInstance res(Platform::MappedFile{});
+			res.setCounts(super_blocks, descriptors);
+			res.mapping_ = Platform::mapFile(path, imageSize(super_blocks), true, true, TotalSize);
+			res.data_ = res.mapping_.data;
+			res.io_ = std::make_unique<Platform::AsyncIO>(Platform::FileHandle{ res.mapping_.file });
+			res.format();
+			res.indexFormatted();
+			return res;
+		}
+
+		static MemoryInstance openImage(const char* path) {
+			MemoryInstance res(Platform::mapFile(path, 0, false, true, TotalSize));
+			if (res.mapping_.size < sizeof(Primitives::Header) || !res.validate(res.mapping_.size))
+				throw new std::invalid_argument("Image geometry mismatch");
+			res.io_ = std::make_unique<Platform::AsyncIO>(Platform::FileHandle{ res.mapping_.file });
+			res.rebuildFreeSummary();
+			res.rebuildDescriptorIndex();
+			return res;
+		}
+
+		// Opens an image whose metadata changes go through a redo log at
+		// log_path, first replaying what the log holds. The image is mapped
+		// privately and only written by commits, so after a crash it opens in
+		// the state of the last commit, though blocks written just before it may
+		// hold older contents. Every commit_interval mutating calls are
+		// committed as one record; 0 leaves committing to commit().
+		static MemoryInstance openJournaled(const char* path, const char* log_path, num_t commit_interval = DefaultCommitInterval) {
+			num_t sequence = replayJournal(path, log_path);
+			MemoryInstance res(Platform::mapFile(path, 0, false, false, TotalSize));
+			if (res.mapping_.size < sizeof(Primitives::Header) || !res.validate(res.mapping_.size))
+				throw new std::invalid_argument("Image geometry mismatch");
+			res.io_ = std::make_unique<Platform::AsyncIO>(Platform::FileHandle{ res.mapping_.file });
+			res.rebuildFreeSummary();
+			res.rebuildDescriptorIndex();
+			res.journal_ = std::make_unique<Journal>();
+			res.journal_->log = Platform::openFile(log_path, true, true);
+			res.journal_->sequence = sequence;
+			res.journal_->commit_interval = commit_interval;
+			return res;
+		}
+
+		static MemoryInstance createJournaled(const char* path, const char* log_path, num_t commit_interval = DefaultCommitInterval, num_t super_blocks = SuperBlockCount, num_t descriptors = DescriptorCount) {
+			createImage(path, super_blocks, descriptors).sync();
+			auto log = Platform::openFile(log_path, true);
+			Platform::closeFile(log);
+			return openJournaled(path, log_path, commit_interval);
+		}
+
+		bool journaled() const {
+			return journal_ != nullptr;
+		}
+
+		// Reads an image into memory and keeps it as the instance's backing file;
+		// changes reach the image only through flushAsync or sync. The chunks
+		// are read in parallel and, with io_uring, straight into the instance.
+		static MemoryInstance loadImage(const char* path, bool use_ring = true) {
+			auto file = Platform::openFile(path, false);
+			MemoryInstance res(Platform::MappedFile{});
+			res.backing_ = file;
+			num_t size = std::min(Platform::fileSize(file), TotalSize);
+			if (size < sizeof(Primitives::Header))
+				throw new std::invalid_argument("Image geometry mismatch");
+			res.data_ = Platform::allocateMemory(TotalSize, DataAlignment, Platform::MemoryPolicy{});
+			res.io_ = std::make_unique<Platform::AsyncIO>(file, res.data_, TotalSize, use_ring);
+			std::vector<Primitives::Extent> chunks;
+			for (num_t offset = 0; offset < size; offset += LoadChunk)
+				chunks.push_back({ offset, std::min(LoadChunk, size - offset) });
+			res.io_->submit(res.requests(chunks), false).get();
+			if (!res.validate(size))
+				throw new std::invalid_argument("Image geometry mismatch");
+			res.rebuildFreeSummary();
+			res.rebuildDescriptorIndex();
+			return res;
+		}
+
+		bool loaded() const {
+			return backing_.handle != Platform::FileHandle{}.handle;
+		}
+
+		// Opens an image without reading it all into memory. The header,
+		// descriptors and superblock bitmaps stay resident; blocks are read on
+		// access and, past cache_size bytes of them, evicted with their changes
+		// written back. Block references stay valid until the next operation
+		// starts. Like a loaded instance it reaches a consistent image only
+		// through flushAsync or sync, and it cannot run in concurrent mode.
+		static MemoryInstance openCached(const char* path, num_t cache_size) {
+			auto file = Platform::openFile(path, false);
+			MemoryInstance res(Platform::MappedFile{});
+			res.backing_ = file;
+			num_t size = Platform::fileSize(file);
+			if (size < sizeof(Primitives::Header))
+				throw new std::invalid_argument("Image geometry mismatch");
+			auto cache = std::make_unique<Cache>();
+			num_t page = Platform::pageSize();
+			cache->unit = std::max(page, (BlockSize + page - 1) / page * page);
+			cache->units = (TotalSize + cache->unit - 1) / cache->unit;
+			cache->capacity = std::max<num_t>(cache_size / cache->unit, 16);
+			cache->state.assign(cache->units, 0);
+			cache->pinned.assign((cache->units + 63) / 64, 0);
+			cache->dirty.assign((cache->units + 63) / 64, 0);
+			res.data_ = Platform::reserveMemory(cache->units * cache->unit);
+			res.cache_ = std::move(cache);
+			res.io_ = std::make_unique<Platform::AsyncIO>(file);
+
+			auto& pinned = res.cache_->pinned;
+			auto pin = [&](num_t offset, num_t length) {
+				for (num_t unit = offset / res.cache_->unit; unit <= (offset + length - 1) / res.cache_->unit; unit++)
+					if (!(pinned[unit >> 6] & (1ULL << (unit & 63)))) {
+						pinned[unit >> 6] |= 1ULL << (unit & 63);
+						res.cache_->state[unit] = 1;
+						res.cache_->pinned_count++;
+					}
+			};
+			// The header says how many superblock bitmaps there are to read.
+			Platform::readFileAt(file, 0, res.data_, sizeof(Primitives::Header));
+			if (!res.validate(size))
+				throw new std::invalid_argument("Image geometry mismatch");
+			pin(0, SuperBlocksOffset);
+			for (num_t sb = 0; sb < res.super_block_count_; sb++)
+				pin(superBlockOffset(sb), SuperBlockMetadataSize);
+			res.io_->submit(res.requests(res.unitRanges(pinned)), false).get();
+			res.rebuildFreeSummary();
+			res.rebuildDescriptorIndex();
+			return res;
+		}
+
+		bool cached() const {
+			return cache_ != nullptr;
+		}
+
+		CacheStats cacheStats() const {
+			if (!cache_)
+				return { 0, 0, 0, 0, TotalSize };
+			return { cache_->hits, cache_->misses, cache_->evictions, cache_->write_backs, (cache_->resident + cache_->pinned_count) * cache_->unit };
+		}
+
+		// Writes what changed since the last flush to the image in the
+		// background and syncs it, calling done on an I/O thread. No operations
+		// may be in flight while the changes are collected; changes made once
+		// it returns go to the next flush, and on failure the flushed ones are
+		// marked again. Flushes share their change set with checkpoint. A
+		// mapped instance only syncs its image, a journaled one commits first.
+		void flushAsync(Platform::AsyncIO::Callback done) {
+			if (journal_)
+				commit();
+			if (cache_) {
+				auto units = std::exchange(cache_->dirty, std::vector<num_t>(cache_->dirty.size()));
+				units[0] |= 1;
+				auto ranges = unitRanges(units);
+				io_->submit(requests(ranges), true, true, [this, units = std::move(units), done = std::move(done)](bool ok) {
+					if (!ok)
+						for (num_t w = 0; w < units.size(); w++)
+							std::atomic_ref<num_t>(cache_->dirty[w]).fetch_or(units[w], std::memory_order_relaxed);
+					if (done)
+						done(ok);
+				});
+				return;
+			}
+			if (!loaded()) {
+				if (!io_)
+					throw new std::runtime_error("Instance has no image");
+				io_->submit({}, true, true, std::move(done));
+				return;
+			}
+			auto blocks = std::exchange(dirty_blocks_, std::vector<num_t>(dirty_blocks_.size()));
+			auto descriptor_pages = std::exchange(dirty_descriptors_, std::vector<num_t>(dirty_descriptors_.size()));
+			auto super_blocks = std::exchange(dirty_super_blocks_, std::vector<num_t>(dirty_super_blocks_.size()));
+			auto regions = dirtyRegions(blocks, descriptor_pages, super_blocks);
+			io_->submit(requests(regions), true, true, [this, blocks = std::move(blocks), descriptor_pages = std::move(descriptor_pages), super_blocks = std::move(super_blocks), done = std::move(done)](bool ok) {
+				if (!ok) {
+					for (num_t w = 0; w < blocks.size(); w++)
+						std::atomic_ref<num_t>(dirty_blocks_[w]).fetch_or(blocks[w], std::memory_order_relaxed);
+					for (num_t w = 0; w < descriptor_pages.size(); w++)
+						std::atomic_ref<num_t>(dirty_descriptors_[w]).fetch_or(descriptor_pages[w], std::memory_order_relaxed);
+					for (num_t w = 0; w < super_blocks.size(); w++)
+						std::atomic_ref<num_t>(dirty_super_blocks_[w]).fetch_or(super_blocks[w], std::memory_order_relaxed);
+				}
+				if (done)
+					done(ok);
+			});
+		}
+
+		std::future<void> flushAsync() {
+			auto promise = std::make_shared<std::promise<void>>();
+			auto res = promise->get_future();
+			flushAsync([promise](bool ok) {
+				if (ok)
+					promise->set_value();
+				else
+					promise->set_exception(std::make_exception_ptr(new std::runtime_error("Unable to write image file")));
+			});
+			return res;
+		}
+
+		// Reads the given blocks of a loaded instance back from its image,
+		// dropping their contents in memory; nothing may use them meanwhile.
+		void loadBlocks(std::span<const num_t> blocks, Platform::AsyncIO::Callback done) {
+			io_->submit(blockRequests(blocks), false, false, std::move(done));
+		}
+
+		std::future<void> loadBlocks(std::span<const num_t> blocks) {
+			return io_->submit(blockRequests(blocks), false);
+		}
+
+		// Waits for running operations and commits their changes as one record.
+		void commit() {
+			if (!journal_)
+				return;
+			std::unique_lock gate(journal_->gate);
+			commitLocked();
+		}
+
+		bool mapped() const {
+			return mapping_.data != nullptr;
+		}
+
+		void sync(bool wait = true) {
+			if (journal_)
+				commit();
+			else if (loaded())
+				flushAsync().get();
+			else if (mapped())
+				Platform::syncRange(mapping_, 0, TotalSize, wait);
+		}
+
+		void sync(num_t offset, num_t length, bool wait = true) {
+			if (journal_)
+				commit();
+			else if (loaded())
+				flushAsync().get();
+			else if (mapped())
+				Platform::syncRange(mapping_, offset, length, wait);
+		}
+
+		// Writes a point-in-time copy of the instance to an image at path and
+		// opens it; no operations may be in flight. For a mapped instance the
+		// filesystem makes the copy, so with reflinks both images share their
+		// data until either one changes it.
+		MemoryInstance snapshot(const char* path) {
+			sync();
+			if (cache_) {
+				Platform::MappedFile source{};
+				source.file = backing_.handle;
+				Platform::copyImage(path, &source, nullptr, imageSize());
+			}
+			else
+				Platform::copyImage(path, mapped() ? &mapping_ : nullptr, data_, imageSize());
+			return openImage(path);
+		}
+
+		// Writes the header and everything changed since the previous checkpoint
+		// to a delta file at path and returns its size; no operations may be in
+		// flight. The first delta applies to a freshly formatted instance, each
+		// later one to the state the one before it left.
+		num_t checkpoint(const char* path) {
+			auto regions = dirtyRegions(dirty_blocks_, dirty_descriptors_, dirty_super_blocks_);
+			num_t count = regions.size();
+
+			auto& header = getHeader();
+			Primitives::CheckpointHeader delta{ Primitives::CheckpointHeader::Magic, BlockSize, SuperBlockSize, DescriptorCount, SuperBlockCount, header.checkpoint_sequence++, count };
+			num_t size = sizeof(delta) + count * sizeof(Primitives::Extent);
+			auto file = Platform::openFile(path, true);
+			try {
+				Platform::writeFile(file, &delta, sizeof(delta));
+				Platform::writeFile(file, regions.data(), count * sizeof(Primitives::Extent));
+				for (auto& region : regions) {
+					Platform::writeFile(file, data_ + region.start, region.length);
+					size += region.length;
+				}
+				Platform::syncFile(file);
+			}
+			catch (...) {
+				header.checkpoint_sequence--;
+				Platform::closeFile(file);
+				throw;
+			}
+			Platform::closeFile(file);
+
+			std::fill(dirty_blocks_.begin(), dirty_blocks_.end(), 0);
+			std::fill(dirty_descriptors_.begin(), dirty_descriptors_.end(), 0);
+			std::fill(dirty_super_blocks_.begin(), dirty_super_blocks_.end(), 0);
+			return size;
+		}
+
+		// Applies a delta written by checkpoint to an instance in the state it was
+		// taken from; no operations may be in flight. A read error part way
+		// leaves the instance unusable.
+		void applyCheckpoint(const char* path) {
+			auto file = Platform::openFile(path, false);
+			try {
+				Primitives::CheckpointHeader delta;
+				Platform::readFile(file, &delta, sizeof(delta));
+				if (delta.magic != Primitives::CheckpointHeader::Magic
+					|| delta.block_size != BlockSize
+					|| delta.super_block_size != SuperBlockSize
+					|| delta.descriptors_count != DescriptorCount
+					|| delta.super_block_count != SuperBlockCount)
+					throw new std::invalid_argument("Checkpoint geometry mismatch");
+				if (delta.base_sequence != getHeader().checkpoint_sequence)
+					throw new std::invalid_argument("Checkpoint does not follow this instance");
+
+				if (delta.region_count > 1 + DescriptorPages + SuperBlockCount + BlockCount)
+					throw new std::invalid_argument("Corrupt checkpoint");
+				std::vector<Primitives::Extent> regions(delta.region_count);
+				Platform::readFile(file, regions.data(), regions.size() * sizeof(Primitives::Extent));
+				num_t end = 0;
+				for (auto& region : regions) {
+					if (region.start < end || region.start > TotalSize || region.length > TotalSize - region.start)
+						throw new std::invalid_argument("Corrupt checkpoint");
+					end = region.end();
+				}
+				for (auto& region : regions) {
+					// The header leads every delta; one taken after the instance
+					// grew brings the larger counts, and the image grows first.
+					if (region.start == 0) {
+						if (region.length < sizeof(Primitives::Header))
+							throw new std::invalid_argument("Corrupt checkpoint");
+						Primitives::Header header;
+						Platform::readFile(file, &header, sizeof(header));
+						if (header.super_block_count < super_block_count_ || header.descriptors_count < descriptor_count_)
+							throw new std::invalid_argument("Checkpoint shrinks the instance");
+						growTo(header.super_block_count, header.descriptors_count);
+						getHeader() = header;
+						region.start += sizeof(header);
+						region.length -= sizeof(header);
+					}
+					if (region.end() > imageSize())
+						throw new std::invalid_argument("Corrupt checkpoint");
+					if (cache_) {
+						cacheAccess(region.start, region.length, 0);
+						cacheDirty(region.start, region.length);
+					}
+					Platform::readFile(file, data_ + region.start, region.length);
+				}
+			}
+			catch (...) {
+				Platform::closeFile(file);
+				throw;
+			}
+			Platform::closeFile(file);
+			// Blocks were written behind the allocator, so none is known zero.
+			fresh_from_.clear();
+			rebuildFreeSummary();
+			rebuildDescriptorIndex();
+			clearDentries();
+		}
+
+		MemoryInstance(const MemoryInstance&) = delete;
+		MemoryInstance(MemoryInstance&& a)
+		{
+			free_summary_ = a.free_summary_;
+			concurrent_ = a.concurrent_;
+			file_locks_ = std::move(a.file_locks_);
+			heap_mutex_ = std::move(a.heap_mutex_);
+			alloc_hints_ = a.alloc_hints_;
+			live_descriptors_ = std::move(a.live_descriptors_);
+			descriptor_hint_ = a.descriptor_hint_;
+			file_count_ = a.file_count_;
+			dentries_ = std::move(a.dentries_);
+			dirty_blocks_ = std::move(a.dirty_blocks_);
+			dirty_descriptors_ = std::move(a.dirty_descriptors_);
+			dirty_super_blocks_ = std::move(a.dirty_super_blocks_);
+			journal_ = std::move(a.journal_);
+			// Pending completions refer to a.
+			if (a.io_)
+				a.io_->drain();
+			io_ = std::move(a.io_);
+			backing_ = std::exchange(a.backing_, {});
+			cache_ = std::move(a.cache_);
+			memory_policy_ = a.memory_policy_;
+			super_block_count_ = a.super_block_count_;
+			descriptor_count_ = a.descriptor_count_;
+			freed_blocks_ = std::move(a.freed_blocks_);
+			freed_count_ = a.freed_count_;
+			reclaim_granule_ = a.reclaim_granule_;
+			fresh_from_ = std::move(a.fresh_from_);
+			mapping_ = a.mapping_;
+			a.mapping_ = {};
+			data_ = a.transfer();
+		}
+
+		MemoryInstance& operator=(const MemoryInstance&) = delete;
+		MemoryInstance& operator=(MemoryInstance&& a)
+		{
+			if (&a != this) {
+				release();
+				free_summary_ = a.free_summary_;
+				concurrent_ = a.concurrent_;
+				file_locks_ = std::move(a.file_locks_);
+				heap_mutex_ = std::move(a.heap_mutex_);
+				alloc_hints_ = a.alloc_hints_;
+				live_descriptors_ = std::move(a.live_descriptors_);
+				descriptor_hint_ = a.descriptor_hint_;
+				file_count_ = a.file_count_;
+				dentries_ = std::move(a.dentries_);
+				dirty_blocks_ = std::move(a.dirty_blocks_);
+				dirty_descriptors_ = std::move(a.dirty_descriptors_);
+				dirty_super_blocks_ = std::move(a.dirty_super_blocks_);
+				journal_ = std::move(a.journal_);
+				// Pending completions refer to a.
+				if (a.io_)
+					a.io_->drain();
+				io_ = std::move(a.io_);
+				backing_ = std::exchange(a.backing_, {});
+				cache_ = std::move(a.cache_);
+				memory_policy_ = a.memory_policy_;
+				super_block_count_ = a.super_block_count_;
+				descriptor_count_ = a.descriptor_count_;
+				freed_blocks_ = std::move(a.freed_blocks_);
+				freed_count_ = a.freed_count_;
+				reclaim_granule_ = a.reclaim_granule_;
+				fresh_from_ = std::move(a.fresh_from_);
+				mapping_ = a.mapping_;
+				a.mapping_ = {};
+				data_ = a.transfer();
+			}
+			return *this;
+		}
+
+		~MemoryInstance()
+		{
+			release();
+		}
+
+		// The root directory and the string heap are not counted.
+		num_t fileCount() {
+			auto& header = getHeader();
+			num_t system = (std::atomic_ref<num_t>(header.root_descriptor).load(std::memory_order_relaxed) != 0)
+				+ (std::atomic_ref<num_t>(header.heap_descriptor).load(std::memory_order_relaxed) != 0);
+			return std::atomic_ref<num_t>(file_count_).load(std::memory_order_relaxed) - system;
+		}
+
+		// Descriptors of the root directory and the string heap, which are never
+		// listed or deleted.
+		bool systemDescriptor(num_t index) {
+			auto& header = getHeader();
+			return std::atomic_ref<num_t>(header.root_descriptor).load(std::memory_order_relaxed) == index + 1
+				|| std::atomic_ref<num_t>(header.heap_descriptor).load(std::memory_order_relaxed) == index + 1;
+		}
+
+		num_t payload() {
+			num_t res{0};
+			for (num_t i = 0; i < super_block_count_; i++)
+				res += getSuperBlock(i).takenConcurrent();
+			return res;
+		}
+
+		num_t superBlockCount() const {
+			return super_block_count_;
+		}
+
+		num_t descriptorCount() const {
+			return descriptor_count_;
+		}
+
+		num_t imageSize() const {
+			return imageSize(super_block_count_);
+		}
+
+		// Brings more superblocks and descriptors into use, up to the template
+		// sizes. Blocks keep their addresses: the capacity was reserved when the
+		// instance was made, so only the image file is extended, and the new
+		// superblocks and descriptors start empty. No operations may
+		// be in flight; a journaled instance records the change at its next
+		// commit.
+		void grow(num_t super_blocks, num_t descriptors) {
+			if (super_blocks < super_block_count_ || descriptors < descriptor_count_)
+				throw new std::invalid_argument("Instances cannot shrink");
+			growTo(super_blocks, descriptors);
+		}
+
+		struct FileReference {
+		private:
+			MemoryInstance* mem_inst;
+			num_t index;
+
+			constexpr static const num_t Size0 = 1;
+			constexpr static const num_t Size1 = PtrBlockType::Size;
+			constexpr static const num_t Size2 = Size1 * PtrBlockType::Size;
+			constexpr static const num_t Size3 = Size2 * PtrBlockType::Size;
+
+			constexpr static const num_t TreeCapacity = Size0 + Size1 + Size2 + Size3;
+
+			struct ExtentFeed {
+				std::vector<Primitives::Extent> extents;
+				num_t current = 0;
+				num_t offset = 0;
+
+				num_t next() {
+					num_t res = extents[current].start + offset;
+					if (++offset == extents[current].length) {
+						current++;
+						offset = 0;
+					}
+					return res;
+				}
+			};
+
+			struct BlockReleaser {
+				MemoryInstance* mem_inst;
+				Primitives::Extent run{ 0, 0 };
+				num_t data_released = 0;
+
+				void release(Primitives::Extent extent) {
+					if (run.length != 0 && run.end() == extent.start) {
+						run.length += extent.length;
+						return;
+					}
+					flush();
+					run = extent;
+				}
+
+				void release(num_t block) {
+					release({ block, 1 });
+				}
+
+				void releaseData(Primitives::Extent extent) {
+					data_released += extent.length;
+					release(extent);
+				}
+
+				void flush() {
+					if (run.length != 0)
+						mem_inst->freeRange(run);
+					run.length = 0;
+				}
+			};
+
+			static num_t *rootPtr(Primitives::Descriptor::FileData& data, num_t depth) {
+				switch (depth) {
+				case 0: return &data.data_0_ptr;
+				case 1: return &data.data_1_ptr;
+				case 2: return &data.data_2_ptr;
+				default: return &data.data_3_ptr;
+				}
+			}
+
+			template<typename Callback>
+			void forEachRoot(num_t from, num_t to, Callback&& callback) {
+				if (to > TreeCapacity)
+					throw new std::out_of_range("Unindexed block");
+
+				auto& data = descriptor().data;
+				num_t base = 0;
+				for (num_t depth = 0; depth < 4 && base < to; depth++) {
+					num_t capacity = CPower(PtrBlockType::Size, depth);
+					if (from < base + capacity)
+						callback(*rootPtr(data, depth), depth, std::max(from, base) - base, std::min(to, base + capacity) - base);
+					base += capacity;
+				}
+			}
+
+			void growSubtree(num_t& ptr, num_t depth, num_t from, num_t to, ExtentFeed& feed) {
+				if (depth == 0) {
+					ptr = feed.next();
+					return;
+				}
+				if (ptr == 0)
+					ptr = mem_inst->allocateSingleBlock<BlockSize>();
+				else
+					ownPtrBlock(ptr);
+				mem_inst->markBlockDirty(ptr, true);
+
+				auto& block = mem_inst->getPtrBlock(ptr);
+				if (depth == 1) {
+					for (num_t i = from; i < to; i++)
+						block.ptrs[i] = feed.next();
+					return;
+				}
+
+				num_t span = CPower(PtrBlockType::Size, depth - 1);
+				for (num_t i = from / span; i * span < to; i++)
+					growSubtree(block.ptrs[i], depth - 1, std::max(from, i * span) - i * span, std::min(to, (i + 1) * span) - i * span, feed);
+			}
+
+			// Undoes a growSubtree of a range that was all holes: unmaps what it
+			// mapped and frees the pointer blocks that are left empty.
+			void dropSubtree(num_t& ptr, num_t depth, num_t from, num_t to, BlockReleaser& releaser) {
+				if (ptr == 0)
+					return;
+				if (depth == 0) {
+					releaser.releaseData({ ptr, 1 });
+					ptr = 0;
+					return;
+				}
+				auto& block = mem_inst->getPtrBlock(ptr);
+				if (depth == 1)
+					for (num_t i = from; i < to; i++) {
+						if (block.ptrs[i] == 0)
+							continue;
+						mem_inst->markBlockDirty(ptr, true);
+						releaser.releaseData({ block.ptrs[i], 1 });
+						block.ptrs[i] = 0;
+					}
+				else {
+					num_t span = CPower(PtrBlockType::Size, depth - 1);
+					for (num_t i = from / span; i * span < to; i++) {
+						num_t child = block.ptrs[i];
+						dropSubtree(block.ptrs[i], depth - 1, std::max(from, i * span) - i * span, std::min(to, (i + 1) * span) - i * span, releaser);
+						if (block.ptrs[i] != child)
+							mem_inst->markBlockDirty(ptr, true);
+					}
+				}
+				if (std::all_of(block.ptrs.begin(), block.ptrs.end(), [](num_t child) { return child == 0; })) {
+					releaser.release(ptr);
+					ptr = 0;
+				}
+			}
+
+			void shrinkSubtree(num_t& ptr, num_t depth, num_t from, num_t to, BlockReleaser& releaser) {
+				if (ptr == 0)
+					return;
+				if (depth == 0) {
+					releaser.releaseData({ ptr, 1 });
+					ptr = 0;
+					return;
+				}
+				if (from != 0)
+					ownPtrBlock(ptr);
+				else if (mem_inst->blockShared(ptr)) {
+					num_t mapped = countMapped(ptr, depth);
+					if (mem_inst->dropShare(ptr)) {
+						releaser.data_released += mapped;
+						ptr = 0;
+						return;
+					}
+				}
+				{
+					mem_inst->markBlockDirty(ptr, true);
+					auto& block = mem_inst->getPtrBlock(ptr);
+					if (depth == 1)
+						for (num_t i = from; i < to; i++) {
+							if (block.ptrs[i] == 0)
+								continue;
+							releaser.releaseData({ block.ptrs[i], 1 });
+							block.ptrs[i] = 0;
+						}
+					else {
+						num_t span = CPower(PtrBlockType::Size, depth - 1);
+						for (num_t i = from / span; i * span < to; i++)
+							shrinkSubtree(block.ptrs[i], depth - 1, std::max(from, i * span) - i * span, std::min(to, (i + 1) * span) - i * span, releaser);
+					}
+				}
+				if (from == 0) {
+					releaser.release(ptr);
+					ptr = 0;
+				}
+			}
+
+			num_t countMapped(num_t ptr, num_t depth) {
+				if (depth == 0)
+					return 1;
+				num_t res = 0;
+				for (num_t child : mem_inst->getPtrBlock(ptr).ptrs)
+					if (child != 0)
+						res += countMapped(child, depth - 1);
+				return res;
+			}
+
+			// Replaces a pointer block shared with a clone by a private copy that
+			// takes its own reference on every child.
+			void ownPtrBlock(num_t& ptr) {
+				if (!mem_inst->blockShared(ptr))
+					return;
+				num_t copy = mem_inst->allocateSingleBlock();
+				auto& source = mem_inst->getPtrBlock(ptr);
+				mem_inst->getPtrBlock(copy) = source;
+				for (num_t child : source.ptrs)
+					if (child != 0)
+						mem_inst->shareBlock(child);
+				if (!mem_inst->dropShare(ptr)) {
+					// The other owners let go meanwhile, so the original is ours to free.
+					for (num_t child : source.ptrs)
+						if (child != 0)
+							mem_inst->dropShare(child);
+					mem_inst->freeSingleBlock(ptr);
+				}
+				ptr = copy;
+			}
+
+			void ownDataBlock(num_t& ptr) {
+				if (!mem_inst->blockShared(ptr))
+					return;
+				num_t copy = mem_inst->allocateSingleBlock();
+				mem_inst->getBlock(copy) = mem_inst->getBlock(ptr);
+				mem_inst->freeSingleBlock(ptr);
+				ptr = copy;
+			}
+
+			void unshareSubtree(num_t& ptr, num_t depth, num_t from, num_t to) {
+				if (ptr == 0)
+					return;
+				if (depth == 0) {
+					ownDataBlock(ptr);
+					return;
+				}
+				ownPtrBlock(ptr);
+				mem_inst->markBlockDirty(ptr, true);
+				auto& block = mem_inst->getPtrBlock(ptr);
+				num_t span = CPower(PtrBlockType::Size, depth - 1);
+				for (num_t i = from / span; i * span < to; i++)
+					unshareSubtree(block.ptrs[i], depth - 1, std::max(from, i * span) - i * span, std::min(to, (i + 1) * span) - i * span);
+			}
+
+			using IndexEntry = ExtentNode::IndexEntry;
+
+			struct InsertResult {
+				bool merged;
+				bool split;
+				IndexEntry sibling;
+			};
+
+			template<typename Entry>
+			static auto& nodeEntries(ExtentNode& node) {
+				if constexpr (std::is_same_v<Entry, Primitives::MappedExtent>)
+					return node.extents;
+				else
+					return node.children;
+			}
+
+			template<typename Entry>
+			static num_t upperEntry(ExtentNode& node, num_t logical) {
+				auto& entries = nodeEntries<Entry>(node);
+				return std::upper_bound(entries.begin(), entries.begin() + node.count, logical, [](num_t value, const Entry& e) { return value < e.logical; }) - entries.begin();
+			}
+
+			static bool adjacent(const Primitives::MappedExtent& a, const Primitives::MappedExtent& b) {
+				return a.end() == b.logical && a.physical + a.length == b.physical;
+			}
+
+			template<typename Entry>
+			InsertResult insertEntry(num_t node_ptr, num_t pos, const Entry& entry) {
+				constexpr const num_t Capacity = std::tuple_size_v<std::remove_reference_t<decltype(nodeEntries<Entry>(std::declval<ExtentNode&>()))>>;
+
+				auto& node = mem_inst->getExtentNode(node_ptr);
+				mem_inst->markBlockDirty(node_ptr, true);
+				InsertResult res{ false, false, {} };
+				ExtentNode* target = &node;
+
+				if (node.count == Capacity) {
+					num_t sibling_ptr = mem_inst->allocateSingleBlock();
+					mem_inst->markBlockDirty(sibling_ptr, true);
+					auto& sibling = mem_inst->getExtentNode(sibling_ptr);
+					num_t half = pos == Capacity ? Capacity : Capacity / 2;
+					sibling.level = node.level;
+					sibling.count = Capacity - half;
+					std::copy(nodeEntries<Entry>(node).begin() + half, nodeEntries<Entry>(node).end(), nodeEntries<Entry>(sibling).begin());
+					node.count = half;
+					if (pos > half || half == Capacity) {
+						target = &sibling;
+						pos -= half;
+					}
+					res.split = true;
+					res.sibling.child = sibling_ptr;
+				}
+
+				auto& entries = nodeEntries<Entry>(*target);
+				std::copy_backward(entries.begin() + pos, entries.begin() + target->count, entries.begin() + target->count + 1);
+				entries[pos] = entry;
+				target->count++;
+				if (res.split)
+					res.sibling.logical = nodeEntries<Entry>(mem_inst->getExtentNode(res.sibling.child))[0].logical;
+				return res;
+			}
+
+			InsertResult insertExtent(num_t& node_ptr, const Primitives::MappedExtent& extent) {
+				ownExtentNode(node_ptr);
+				auto& node = mem_inst->getExtentNode(node_ptr);
+				mem_inst->markBlockDirty(node_ptr, true);
+				if (node.level == 0) {
+					num_t pos = upperEntry<Primitives::MappedExtent>(node, extent.logical);
+					if (pos > 0 && adjacent(node.extents[pos - 1], extent)) {
+						node.extents[pos - 1].length += extent.length;
+						return { true, false, {} };
+					}
+					return insertEntry(node_ptr, pos, extent);
+				}
+
+				num_t pos = upperEntry<IndexEntry>(node, extent.logical);
+				num_t idx = pos > 0 ? pos - 1 : 0;
+				if (extent.logical < node.children[idx].logical)
+					node.children[idx].logical = extent.logical;
+
+				auto child = insertExtent(node.children[idx].child, extent);
+				if (!child.split)
+					return child;
+				return insertEntry(node_ptr, idx + 1, child.sibling);
+			}
+
+			bool insertTreeExtent(Primitives::Descriptor::ExtentData& ext, const Primitives::MappedExtent& extent) {
+				auto res = insertExtent(ext.tree_ptr, extent);
+				if (res.split) {
+					num_t root = mem_inst->allocateSingleBlock();
+					mem_inst->markBlockDirty(root, true);
+					auto& node = mem_inst->getExtentNode(root);
+					node.level = mem_inst->getExtentNode(ext.tree_ptr).level + 1;
+					node.count = 2;
+					node.children[0] = { 0, ext.tree_ptr };
+					node.children[1] = res.sibling;
+					ext.tree_ptr = root;
+				}
+				return res.merged;
+			}
+
+			void insertMapping(const Primitives::MappedExtent& extent) {
+				auto& desc = descriptor();
+				auto& ext = desc.extents();
+				auto& count = desc.header.extent_count;
+
+				if (ext.tree_ptr == 0) {
+					auto runs = ext.runs.begin();
+					num_t pos = std::upper_bound(runs, runs + count, extent.logical, [](num_t value, const Primitives::MappedExtent& e) { return value < e.logical; }) - runs;
+					if (pos > 0 && adjacent(runs[pos - 1], extent)) {
+						runs[pos - 1].length += extent.length;
+						return;
+					}
+					if (count < ext.InlineCount) {
+						std::copy_backward(runs + pos, runs + count, runs + count + 1);
+						runs[pos] = extent;
+						count++;
+						return;
+					}
+
+					array_type<Primitives::MappedExtent, Primitives::Descriptor::ExtentData::InlineCount> moved = ext.runs;
+					ext.tree_ptr = mem_inst->allocateSingleBlock();
+					auto& node = mem_inst->getExtentNode(ext.tree_ptr);
+					node.level = 0;
+					node.count = 0;
+					num32_t moved_count = count;
+					count = 0;
+					for (num_t i = 0; i < moved_count; i++)
+						if (!insertTreeExtent(ext, moved[i]))
+							count++;
+				}
+
+				if (!insertTreeExtent(ext, extent))
+					count++;
+			}
+
+			static num_t truncateRuns(Primitives::MappedExtent* runs, num_t count, num_t blocks, BlockReleaser& releaser) {
+				while (count > 0) {
+					auto& e = runs[count - 1];
+					if (e.logical >= blocks) {
+						releaser.releaseData({ e.physical, e.length });
+						count--;
+						continue;
+					}
+					if (e.end() > blocks) {
+						releaser.releaseData({ e.physical + (blocks - e.logical), e.end() - blocks });
+						e.length = blocks - e.logical;
+					}
+					break;
+				}
+				return count;
+			}
+
+			void releaseSubtree(num_t node_ptr, BlockReleaser& releaser, std::vector<Primitives::MappedExtent>* keep, num32_t& count) {
+				if (keep == nullptr && mem_inst->blockShared(node_ptr)) {
+					num_t extents = 0;
+					num_t blocks = 0;
+					countExtents(node_ptr, extents, blocks);
+					if (mem_inst->dropShare(node_ptr)) {
+						count -= (num32_t)extents;
+						releaser.data_released += blocks;
+						return;
+					}
+				}
+				auto& node = mem_inst->getExtentNode(node_ptr);
+				if (node.level == 0) {
+					for (num_t i = 0; i < node.count; i++)
+						if (keep != nullptr)
+							keep->push_back(node.extents[i]);
+						else
+							releaser.releaseData({ node.extents[i].physical, node.extents[i].length });
+					if (keep == nullptr)
+						count -= (num32_t)node.count;
+				}
+				else
+					for (num_t i = 0; i < node.count; i++)
+						releaseSubtree(node.children[i].child, releaser, keep, count);
+				releaser.release(node_ptr);
+			}
+
+			bool truncateNode(num_t& node_ptr, num_t blocks, BlockReleaser& releaser, num32_t& count) {
+				ownExtentNode(node_ptr);
+				auto& node = mem_inst->getExtentNode(node_ptr);
+				mem_inst->markBlockDirty(node_ptr, true);
+				if (node.level == 0) {
+					num_t left = truncateRuns(node.extents.data(), node.count, blocks, releaser);
+					count -= (num32_t)(node.count - left);
+					node.count = left;
+					return node.count == 0;
+				}
+
+				while (node.count > 0) {
+					auto& entry = node.children[node.count - 1];
+					if (node.count > 1 && entry.logical >= blocks)
+						releaseSubtree(entry.child, releaser, nullptr, count);
+					else if (truncateNode(entry.child, blocks, releaser, count))
+						releaser.release(entry.child);
+					else
+						break;
+					node.count--;
+				}
+				return node.count == 0;
+			}
+
+			void truncateMapping(num_t blocks, BlockReleaser& releaser) {
+				auto& desc = descriptor();
+				auto& ext = desc.extents();
+				auto& count = desc.header.extent_count;
+
+				if (ext.tree_ptr == 0) {
+					count = (num32_t)truncateRuns(ext.runs.data(), count, blocks, releaser);
+					return;
+				}
+
+				if (blocks == 0) {
+					releaseSubtree(ext.tree_ptr, releaser, nullptr, count);
+					ext.tree_ptr = 0;
+				}
+				else if (truncateNode(ext.tree_ptr, blocks, releaser, count)) {
+					releaser.release(ext.tree_ptr);
+					ext.tree_ptr = 0;
+				}
+				else if (count <= ext.InlineCount) {
+					ownExtentRange(ext.tree_ptr, 0, blocks);
+					std::vector<Primitives::MappedExtent> runs;
+					releaseSubtree(ext.tree_ptr, releaser, &runs, count);
+					std::copy(runs.begin(), runs.end(), ext.runs.begin());
+					ext.tree_ptr = 0;
+				}
+			}
+
+			// Points [logical, logical + count), which lies inside one extent, at
+			// new physical blocks, splitting the extent around it.
+			void remapExtent(num_t logical, num_t count, num_t physical) {
+				auto& extent = const_cast<Primitives::MappedExtent&>(*mem_inst->getExtent(descriptor(), logical));
+				mem_inst->markDirty(&extent, true);
+				Primitives::MappedExtent right{ logical + count, extent.physical + (logical + count - extent.logical), extent.end() - (logical + count) };
+				if (logical == extent.logical) {
+					extent.physical = physical;
+					extent.length = count;
+				}
+				else {
+					extent.length = logical - extent.logical;
+					insertMapping({ logical, physical, count });
+				}
+				if (right.length != 0)
+					insertMapping(right);
+			}
+
+			void unshareExtents(num_t from, num_t to) {
+				if (num_t& root = descriptor().extents().tree_ptr; root != 0)
+					ownExtentRange(root, from, to);
+				BlockReleaser releaser{ mem_inst };
+				for (num_t i = from; i < to;) {
+					auto extent = mem_inst->getExtent(descriptor(), i);
+					if (extent == nullptr) {
+						i++;
+						continue;
+					}
+					num_t end = std::min(to, extent->end());
+					num_t base = extent->physical - extent->logical;
+					while (i < end && !mem_inst->blockShared(base + i))
+						i++;
+					num_t j = i;
+					while (j < end && mem_inst->blockShared(base + j))
+						j++;
+					if (i == j)
+						continue;
+					for (auto& copy : mem_inst->allocateRange(j - i)) {
+						for (num_t k = 0; k < copy.length; k++)
+							mem_inst->getBlock(copy.start + k) = mem_inst->getBlock(base + i + k);
+						releaser.release({ base + i, copy.length });
+						remapExtent(i, copy.length, copy.start);
+						i += copy.length;
+					}
+				}
+				releaser.flush();
+			}
+
+			// Gives this file private copies of the blocks in [from, to) it still
+			// shares with a clone.
+			void unshareRange(num_t from, num_t to) {
+				if (!(descriptor().header.layout & Primitives::Descriptor::FileHeader::Shared))
+					return;
+				if (extentMapped())
+					unshareExtents(from, to);
+				else
+					forEachRoot(from, to, [&](num_t& ptr, num_t depth, num_t lo, num_t hi) {
+						unshareSubtree(ptr, depth, lo, hi);
+					});
+			}
+
+			// Extent counterpart of ownPtrBlock: a leaf's copy takes a reference on
+			// every block its extents map, an index node's copy on every child.
+			void ownExtentNode(num_t& node_ptr) {
+				if (!mem_inst->blockShared(node_ptr))
+					return;
+				num_t copy = mem_inst->allocateSingleBlock();
+				mem_inst->markBlockDirty(copy, true);
+				auto& node = mem_inst->getExtentNode(copy);
+				node = mem_inst->getExtentNode(node_ptr);
+				for (num_t i = 0; i < node.count; i++)
+					if (node.level == 0)
+						mem_inst->shareRange({ node.extents[i].physical, node.extents[i].length });
+					else
+						mem_inst->shareBlock(node.children[i].child);
+				if (!mem_inst->dropShare(node_ptr)) {
+					// The other owners let go meanwhile, so the original is ours to free.
+					for (num_t i = 0; i < node.count; i++)
+						if (node.level == 0)
+							for (num_t k = 0; k < node.extents[i].length; k++)
+								mem_inst->dropShare(node.extents[i].physical + k);
+						else
+							mem_inst->dropShare(node.children[i].child);
+					mem_inst->freeSingleBlock(node_ptr);
+				}
+				node_ptr = copy;
+			}
+
+			// Owns every node on the paths to the extents that map [from, to).
+			void ownExtentRange(num_t& node_ptr, num_t from, num_t to) {
+				ownExtentNode(node_ptr);
+				auto& node = mem_inst->getExtentNode(node_ptr);
+				if (node.level == 0)
+					return;
+				mem_inst->markBlockDirty(node_ptr, true);
+				for (num_t i = 0; i < node.count; i++) {
+					num_t end = i + 1 < node.count ? node.children[i + 1].logical : to;
+					if ((i == 0 || node.children[i].logical < to) && end > from)
+						ownExtentRange(node.children[i].child, from, to);
+				}
+			}
+
+			void countExtents(num_t node_ptr, num_t& extents, num_t& blocks) {
+				auto& node = mem_inst->getExtentNode(node_ptr);
+				if (node.level == 0) {
+					extents += node.count;
+					for (num_t i = 0; i < node.count; i++)
+						blocks += node.extents[i].length;
+				}
+				else
+					for (num_t i = 0; i < node.count; i++)
+						countExtents(node.children[i].child, extents, blocks);
+			}
+
+			bool extentMapped() {
+				return (descriptor().header.layout & Primitives::Descriptor::FileHeader::MappingMask) == Primitives::Descriptor::FileHeader::Extents;
+			}
+
+			void materialize(num_t from, num_t amount) {
+				descriptor().header.blocks += amount;
+				if (extentMapped()) {
+					for (auto& extent : mem_inst->allocateRange<BlockSize>(amount)) {
+						insertMapping({ from, extent.start, extent.length });
+						from += extent.length;
+					}
+					return;
+				}
+
+				ExtentFeed feed{ mem_inst->allocateRange<BlockSize>(amount) };
+				try {
+					forEachRoot(from, from + amount, [&](num_t& ptr, num_t depth, num_t lo, num_t hi) {
+						growSubtree(ptr, depth, lo, hi, feed);
+					});
+				}
+				catch (std::bad_alloc*) {
+					BlockReleaser releaser{ mem_inst };
+					forEachRoot(from, from + amount, [&](num_t& ptr, num_t depth, num_t lo, num_t hi) {
+						dropSubtree(ptr, depth, lo, hi, releaser);
+					});
+					for (num_t i = feed.current; i < feed.extents.size(); i++) {
+						auto& extent = feed.extents[i];
+						releaser.release({ extent.start + (i == feed.current ? feed.offset : 0), extent.length - (i == feed.current ? feed.offset : 0) });
+					}
+					releaser.flush();
+					descriptor().header.blocks -= amount;
+					throw;
+				}
+			}
+
+			void deallocate(num_t amount) {
+				num_t to = getAllocatedBlockCount();
+				BlockReleaser releaser{ mem_inst };
+				if (extentMapped())
+					truncateMapping(to - amount, releaser);
+				else
+					forEachRoot(to - amount, to, [&](num_t& ptr, num_t depth, num_t lo, num_t hi) {
+						shrinkSubtree(ptr, depth, lo, hi, releaser);
+					});
+				releaser.flush();
+				descriptor().header.blocks -= releaser.data_released;
+			}
+
+			void materializeRange(num_t from, num_t to) {
+				BlockCursor cursor(this);
+				for (num_t i = from; i < to;) {
+					if (cursor.map(i) != 0) {
+						i++;
+						continue;
+					}
+					num_t j = i + 1;
+					while (j < to && cursor.map(j) == 0)
+						j++;
+					materialize(i, j - i);
+					cursor.invalidate();
+					i = j;
+				}
+			}
+
+			FileReference() = default;
+
+			void initFile(Primitives::Descriptor::FileHeader::Layout layout) {
+				descriptor().attributes.flags |= descriptor().attributes.EX;
+				descriptor().initEmpty();
+				descriptor().header.layout = layout;
+			}
+
+			// Null when locking is off, for the string heap, or when the calling
+			// thread already holds the stripe.
+			FileLock* fileLock() {
+				if (!mem_inst->concurrent_ || std::atomic_ref<num_t>(mem_inst->getHeader().heap_descriptor).load(std::memory_order_relaxed) == index + 1)
+					return nullptr;
+				FileLock* lock = &mem_inst->fileLock(index);
+				for (HeldLock* held = held_locks_; held != nullptr; held = held->previous)
+					if (held->lock == lock)
+						return nullptr;
+				return lock;
+			}
+
+			// Marks an operation on a cached instance; the outermost one first
+			// brings the cache back under capacity.
+			struct CacheScope {
+				Cache* cache;
+
+				CacheScope(MemoryInstance* inst) : cache(inst->cache_.get()) {
+					if (cache == nullptr)
+						return;
+					if (cache->depth == 0)
+						inst->trimCache();
+					cache->depth++;
+				}
+
+				~CacheScope() {
+					if (cache != nullptr)
+						cache->depth--;
+				}
+			};
+
+			struct WriteGuard {
+				CacheScope scope;
+				HeldLock held;
+				Journal* journal = nullptr;
+
+				MemoryInstance* inst;
+
+				WriteGuard(FileReference* file) : scope(file->mem_inst), held{ file->fileLock(), held_locks_ }, inst(file->mem_inst) {
+					if (file->mem_inst->journal_ && guard_depth_ == 0)
+						journal = file->mem_inst->enterJournal();
+					guard_depth_++;
+					file->mem_inst->markDescriptorDirty(file->index);
+					if (held.lock == nullptr)
+						return;
+					held.lock->mutex.lock();
+					held_locks_ = &held;
+				}
+
+				~WriteGuard() {
+					if (held.lock != nullptr) {
+						held_locks_ = held.previous;
+						held.lock->mutex.unlock();
+					}
+					guard_depth_--;
+					if (journal != nullptr) {
+						journal->pending.fetch_add(1, std::memory_order_relaxed);
+						journal->gate.unlock_shared();
+					}
+					else if (guard_depth_ == 0 && !inst->concurrent_)
+						inst->reclaimIfDue();
+				}
+			};
+
+			// Write guards on two files, taken in stripe order so that threads
+			// locking the same two stripes cannot deadlock.
+			struct PairGuard {
+				WriteGuard first;
+				WriteGuard second;
+
+				PairGuard(FileReference* a, FileReference* b) : first(ordered(a, b) ? a : b), second(ordered(a, b) ? b : a) {}
+
+				static bool ordered(FileReference* a, FileReference* b) {
+					return a->index % LockStripes <= b->index % LockStripes;
+				}
+			};
+
+			// Runs a side-effect free read with the file's lock held shared.
+			template<typename Operation>
+			auto readLocked(Operation&& operation) {
+				CacheScope scope(mem_inst);
+				FileLock* lock = fileLock();
+				if (lock == nullptr)
+					return operation();
+				std::shared_lock guard(lock->mutex);
+				return operation();
+			}
+
+			constexpr static const num_t DirectoryInitialCapacity = 16;
+			constexpr static const num_t HeapMinSlot = 16;
+
+			// The string heap is a file of slab blocks: block 0 keeps a free list
+			// head per power-of-two size class, every other block is cut into
+			// equal slots of one class, so a slot never straddles blocks.
+			FileReference heap() {
+				std::atomic_ref<num_t> heap_ptr(mem_inst->getHeader().heap_descriptor);
+				num_t current = heap_ptr.load(std::memory_order_acquire);
+				if (current != 0)
+					return fileAt(current - 1, mem_inst);
+				// Published before it is set up: users wait on the heap lock.
+				auto lock = mem_inst->heapLock();
+				current = heap_ptr.load(std::memory_order_acquire);
+				if (current != 0)
+					return fileAt(current - 1, mem_inst);
+				FileReference res = fileAt(mem_inst->acquireDescriptor(), mem_inst);
+				heap_ptr.store(res.index + 1, std::memory_order_release);
+				WriteGuard guard(&res);
+				res.initFile(Primitives::Descriptor::FileHeader::Indirect);
+				res.resizeFile(BlockSize, true);
+				return res;
+			}
+
+			FileReference heapFile() {
+				return fileAt(mem_inst->getHeader().heap_descriptor - 1, mem_inst);
+			}
+
+			byte_t* heapBytes(num_t offset) {
+				return mem_inst->getBlock(mem_inst->getIndexedPtr(index, offset / BlockSize)).data.data() + offset % BlockSize;
+			}
+
+			static num_t heapClass(num_t size) {
+				return size <= HeapMinSlot ? 0 : std::bit_width(size - 1) - std::countr_zero(HeapMinSlot);
+			}
+
+			num_t heapAllocate(num_t size) {
+				static_assert(std::has_single_bit(BlockSize), "The string heap cuts blocks into power-of-two slots");
+				if (size > BlockSize)
+					throw new std::length_error("Heap record is too large");
+				WriteGuard guard(this);
+				auto lock = mem_inst->heapLock();
+				num_t size_class = heapClass(size);
+				num_t slot = HeapMinSlot << size_class;
+				num_t* heads = reinterpret_cast<num_t*>(heapBytes(0));
+				if (heads[size_class] == 0) {
+					num_t base = this->size();
+					resizeFile(base + BlockSize, true);
+					byte_t* block = heapBytes(base);
+					mem_inst->markDirty(block, true);
+					for (num_t i = BlockSize; i > 0; i -= slot) {
+						std::memcpy(block + i - slot, &heads[size_class], sizeof(num_t));
+						heads[size_class] = base + i - slot;
+					}
+				}
+				num_t res = heads[size_class];
+				std::memcpy(&heads[size_class], heapBytes(res), sizeof(num_t));
+				mem_inst->markDirty(heads, true);
+				return res;
+			}
+
+			void heapFree(num_t offset, num_t size) {
+				WriteGuard guard(this);
+				auto lock = mem_inst->heapLock();
+				num_t* heads = reinterpret_cast<num_t*>(heapBytes(0));
+				num_t size_class = heapClass(size);
+				std::memcpy(heapBytes(offset), &heads[size_class], sizeof(num_t));
+				heads[size_class] = offset;
+				mem_inst->markDirty(heads, true);
+				mem_inst->markDirty(heapBytes(offset), true);
+			}
+
+			std::string_view nameView() {
+				auto& name = descriptor().header.name;
+				if (!name.external())
+					return { name.data.data(), (size_t)name.length() };
+				return { reinterpret_cast<const char*>(heapFile().heapBytes(name.heapOffset())), (size_t)name.length() };
+			}
+
+			bool nameEquals(std::string_view name, num_t hash) {
+				auto& ref = descriptor().header.name;
+				return ref.hash == hash && ref.length() == name.size() && nameView() == name;
+			}
+
+			constexpr static const num_t InlineCapacity = sizeof(Primitives::Descriptor::FileData);
+			constexpr static const num_t PackLimit = BlockSize / 2;
+
+			num32_t storage() {
+				return descriptor().header.layout & Primitives::Descriptor::FileHeader::StorageMask;
+			}
+
+			// Bytes of an inline or packed file; the packed record offset is kept in
+			// the first extra slot.
+			byte_t* smallData() {
+				auto& desc = descriptor();
+				if (desc.header.layout & Primitives::Descriptor::FileHeader::Inline)
+					return reinterpret_cast<byte_t*>(&desc.data);
+				return heapFile().heapBytes(desc.data.extra[0]);
+			}
+
+			void resizeMapped(num_t new_size, bool preallocate) {
+				auto& desc = descriptor();
+				num_t allocated_blocks = (desc.header.size + BlockSize - 1) / BlockSize;
+				num_t required_block = (new_size + BlockSize - 1) / BlockSize;
+				if (required_block > allocated_blocks && preallocate)
+					materialize(allocated_blocks, required_block - allocated_blocks);
+				if (required_block < allocated_blocks)
+					deallocate(allocated_blocks - required_block);
+				if (new_size < desc.header.size && new_size % BlockSize != 0) {
+					unshareRange(new_size / BlockSize, new_size / BlockSize + 1);
+					num_t tail = mem_inst->getIndexedPtr(index, new_size / BlockSize);
+					if (tail != 0) {
+						std::memset(mem_inst->getBlock(tail).data.data() + new_size % BlockSize, 0, BlockSize - new_size % BlockSize);
+						mem_inst->markBlockDirty(tail);
+					}
+				}
+				if (new_size == 0)
+					desc.header.layout &= ~Primitives::Descriptor::FileHeader::Shared;
+				desc.header.size = new_size;
+			}
+
+			// Moves a small file between inline, packed and block storage. Bytes
+			// past size are kept zero so growing in place needs no clearing.
+			void resizeSmall(num_t new_size, bool preallocate) {
+				using FileHeader = Primitives::Descriptor::FileHeader;
+				auto& desc = descriptor();
+				num_t old_size = desc.header.size;
+				num32_t from = storage();
+				num32_t to = new_size == 0 || new_size > PackLimit ? num32_t(0) : new_size <= InlineCapacity ? num32_t(FileHeader::Inline) : num32_t(FileHeader::Packed);
+				if (from == to && (to != FileHeader::Packed || heapClass(old_size) == heapClass(new_size))) {
+					if (new_size < old_size) {
+						std::memset(smallData() + new_size, 0, old_size - new_size);
+						mem_inst->markDirty(smallData());
+					}
+					desc.header.size = new_size;
+					return;
+				}
+
+				std::vector<byte_t> content(std::min(old_size, new_size));
+				if (from != 0 && !content.empty())
+					std::memcpy(content.data(), smallData(), content.size());
+				if (from == FileHeader::Packed)
+					heap().heapFree(desc.data.extra[0], old_size);
+				desc.data.initEmpty();
+				desc.header.layout &= ~FileHeader::StorageMask;
+				desc.header.size = 0;
+
+				if (to == 0) {
+					resizeMapped(new_size, preallocate);
+					if (!content.empty())
+						writeUnlocked(0, content);
+					return;
+				}
+				if (to == FileHeader::Packed) {
+					auto heap_file = heap();
+					desc.data.extra[0] = heap_file.heapAllocate(new_size);
+					std::memset(heap_file.heapBytes(desc.data.extra[0]), 0, HeapMinSlot << heapClass(new_size));
+					mem_inst->markDirty(heap_file.heapBytes(desc.data.extra[0]));
+				}
+				desc.header.layout |= to;
+				desc.header.size = new_size;
+				if (!content.empty())
+					std::memcpy(smallData(), content.data(), content.size());
+			}
+
+			// Moves a small file to block storage, e.g. before handing out raw blocks.
+			void promote() {
+				std::vector<byte_t> content(size());
+				std::memcpy(content.data(), smallData(), content.size());
+				resizeSmall(0, false);
+				resizeMapped(content.size(), false);
+				writeUnlocked(0, content);
+			}
+
+			void setLinked(bool value) {
+				WriteGuard guard(this);
+				if (value)
+					descriptor().header.layout |= Primitives::Descriptor::FileHeader::Linked;
+				else
+					descriptor().header.layout &= ~Primitives::Descriptor::FileHeader::Linked;
+			}
+
+			void releaseName() {
+				auto& name = descriptor().header.name;
+				if (name.external())
+					heap().heapFree(name.heapOffset(), name.length());
+				name.initEmpty();
+			}
+
+			Primitives::DirectoryEntry& directoryEntry(num_t slot) {
+				num_t pos = slot * sizeof(Primitives::DirectoryEntry);
+				auto& block = mem_inst->getBlock(mem_inst->getIndexedPtr(index, pos / BlockSize));
+				return reinterpret_cast<Primitives::DirectoryEntry*>(block.data.data())[pos % BlockSize / sizeof(Primitives::DirectoryEntry)];
+			}
+
+			void setEntry(num_t slot, const Primitives::DirectoryEntry& entry) {
+				auto& target = directoryEntry(slot);
+				target = entry;
+				mem_inst->markDirty(&target, true);
+			}
+
+			void initDirectory(num_t capacity) {
+				resizeFile(0);
+				resizeFile((capacity + 1) * sizeof(Primitives::DirectoryEntry), true);
+				setEntry(0, { 0, capacity });
+			}
+
+			num_t findEntry(std::string_view name, num_t hash) {
+				num_t capacity = directoryEntry(0).descriptor;
+				for (num_t i = hash & (capacity - 1), probes = 0; probes < capacity; i = (i + 1) & (capacity - 1), probes++) {
+					auto& entry = directoryEntry(i + 1);
+					if (entry.descriptor == 0)
+						return 0;
+					if (entry.hash == hash && fileAt(entry.descriptor - 1, mem_inst).nameEquals(name, hash))
+						return i + 1;
+				}
+				return 0;
+			}
+
+			void placeEntry(num_t hash, num_t descriptor_index) {
+				num_t mask = directoryEntry(0).descriptor - 1;
+				num_t i = hash & mask;
+				while (directoryEntry(i + 1).descriptor != 0)
+					i = (i + 1) & mask;
+				setEntry(i + 1, { hash, descriptor_index + 1 });
+			}
+
+			void growDirectory() {
+				num_t capacity = directoryEntry(0).descriptor;
+				std::vector<Primitives::DirectoryEntry> entries;
+				entries.reserve(directoryEntry(0).hash);
+				for (num_t i = 1; i <= capacity; i++)
+					if (directoryEntry(i).descriptor != 0)
+						entries.push_back(directoryEntry(i));
+				initDirectory(capacity * 2);
+				for (auto& entry : entries)
+					placeEntry(entry.hash, entry.descriptor - 1);
+				setEntry(0, { entries.size(), capacity * 2 });
+			}
+
+			// Backward-shift deletion keeps probe chains intact without tombstones.
+			void removeEntry(num_t slot) {
+				num_t mask = directoryEntry(0).descriptor - 1;
+				num_t hole = slot - 1;
+				for (num_t i = (hole + 1) & mask; directoryEntry(i + 1).descriptor != 0; i = (i + 1) & mask) {
+					num_t home = directoryEntry(i + 1).hash & mask;
+					if (((i - home) & mask) >= ((i - hole) & mask)) {
+						setEntry(hole + 1, directoryEntry(i + 1));
+						hole = i;
+					}
+				}
+				setEntry(hole + 1, { 0, 0 });
+				setEntry(0, { directoryEntry(0).hash - 1, mask + 1 });
+			}
+
+		public:
+			constexpr static const num_t MaxNameLength = BlockSize;
+
+			Primitives::Descriptor& descriptor() {
+				return mem_inst->getDescriptor(index);
+			}
+
+			bool exsits() {
+				return descriptor().attributes.flags & descriptor().attributes.EX;
+			}
+
+			bool isDirectory() {
+				return descriptor().attributes.flags & descriptor().attributes.DR;
+			}
+
+			bool linked() {
+				return descriptor().header.layout & Primitives::Descriptor::FileHeader::Linked;
+			}
+
+			// Does not touch directory entries; rename a linked file by unlinking
+			// and linking it again.
+			void setName(std::string name, bool except_on_oversize = true) {
+				WriteGuard guard(this);
+				if (name.size() > MaxNameLength) {
+					if (except_on_oversize)
+						throw new std::length_error("File name is too long");
+					name.resize(MaxNameLength);
+				}
+				releaseName();
+				num_t hash = hashName(name);
+				if (name.size() <= Primitives::NameRef::InlineSize) {
+					descriptor().header.name.setInline(name, hash);
+					return;
+				}
+				auto heap_file = heap();
+				num_t offset = heap_file.heapAllocate(name.size());
+				std::memcpy(heap_file.heapBytes(offset), name.data(), name.size());
+				mem_inst->markDirty(heap_file.heapBytes(offset), true);
+				descriptor().header.name.setExternal(offset, (num32_t)name.size(), hash);
+			}
+
+			std::string getName() {
+				return readLocked([&]() { return std::string(nameView()); });
+			}
+
+			// A linked file has to be unlinked from its directory first.
+			void deletFile() {
+				WriteGuard guard(this);
+				if (!exsits())
+					return;
+				if (linked())
+					throw new std::invalid_argument("File is still linked");
+				if (mem_inst->systemDescriptor(index))
+					throw new std::invalid_argument("System files cannot be deleted");
+				if (isDirectory())
+					mem_inst->clearDentries();
+				descriptor().attributes.flags &= ~(descriptor().attributes.EX | descriptor().attributes.DR);
+				releaseName();
+
+				if (storage() != 0)
+					resizeSmall(0, false);
+				else
+					deallocate(getAllocatedBlockCount());
+				descriptor().header.size = 0;
+				mem_inst->releaseDescriptor(index);
+			}
+			void createFile(Primitives::Descriptor::FileHeader::Layout layout = Primitives::Descriptor::FileHeader::Indirect) {
+				WriteGuard guard(this);
+				if (!mem_inst->claimDescriptor(index))
+					throw new std::bad_alloc();
+				initFile(layout);
+			}
+			// An empty file grown without preallocation to at most PackLimit bytes is
+			// stored inline or packed in the string heap; it moves to blocks once it
+			// outgrows that and stays there until truncated to zero.
+			void resizeFile(num_t new_size, bool preallocate = false) {
+				WriteGuard guard(this);
+				if (storage() != 0 || (size() == 0 && !preallocate && !isDirectory() && new_size <= PackLimit))
+					resizeSmall(new_size, preallocate);
+				else
+					resizeMapped(new_size, preallocate);
+			}
+			// Block index of the file for writing: a hole is allocated first and
+			// the block is marked changed. On journaled and cached instances the
+			// change is only tracked until the next operation starts, which may
+			// commit or evict the block, so write before making other calls and
+			// call getBlock again to write later. Reads go through readBlock.
+			BlockType& getBlock(num_t index) {
+				WriteGuard guard(this);
+				if (storage() != 0)
+					promote();
+				unshareRange(index, index + 1);
+				num_t ptr = mem_inst->getIndexedPtr(this->index, index);
+				if (ptr == 0) {
+					materialize(index, 1);
+					ptr = mem_inst->getIndexedPtr(this->index, index);
+				}
+				mem_inst->markBlockDirty(ptr);
+				return mem_inst->getBlock(ptr);
+			}
+			// Block index of the file for reading; holes read as zeros and stay
+			// unallocated. A small file's bytes are copied into a per-thread block
+			// that the next such call on the thread overwrites.
+			const BlockType& readBlock(num_t index) {
+				return *readLocked([&]() -> const BlockType* {
+					if (storage() != 0) {
+						num_t offset = std::min(index * BlockSize, size());
+						num_t length = std::min(BlockSize, size() - offset);
+						small_block_ = zero_block_;
+						std::memcpy(small_block_.data.data(), smallData() + offset, length);
+						return &small_block_;
+					}
+					num_t ptr = mem_inst->getIndexedPtr(this->index, index);
+					return ptr != 0 ? &mem_inst->getBlock(ptr) : &zero_block_;
+				});
+			}
+			num_t payload() {
+				return descriptor().header.blocks;
+			}
+			num_t getAllocatedBlockCount() {
+				return (descriptor().header.size + BlockSize - 1) / BlockSize;
+			}
+			num_t size() {
+				return descriptor().header.size;
+			}
+
+			num_t read(num_t offset, std::span<byte_t> buffer) {
+				return readLocked([&]() {
+					return inPieces(buffer.size(), [&](num_t at, num_t count) { return readUnlocked(offset + at, buffer.subspan(at, count)); });
+				});
+			}
+
+			num_t write(num_t offset, std::span<const byte_t> buffer) {
+				WriteGuard guard(this);
+				return inPieces(buffer.size(), [&](num_t at, num_t count) { return writeUnlocked(offset + at, buffer.subspan(at, count)); });
+			}
+
+			// The spans are read-only: holes show the shared zero block, and writes
+			// through them would miss the journal and checkpoints. In concurrent
+			// mode the file stays share-locked for the whole visit, so the callback
+			// must not modify it.
+			template<typename Callback>
+			num_t forEachSpan(num_t offset, num_t length, Callback&& callback) {
+				CacheScope scope(mem_inst);
+				// A stop on the last span of a piece must still end the visit.
+				bool stopped = false;
+				auto watched = [&](std::span<const byte_t> span) {
+					if constexpr (std::is_same_v<std::invoke_result_t<Callback&, std::span<const byte_t>>, bool>)
+						return !(stopped = !callback(span));
+					else {
+						callback(span);
+						return true;
+					}
+				};
+				auto visit = [&](num_t at, num_t count) { return stopped ? num_t(0) : forEachSpanUnlocked(offset + at, count, watched); };
+				FileLock* lock = fileLock();
+				if (lock == nullptr)
+					return inPieces(length, visit);
+				std::shared_lock guard(lock->mutex);
+				return inPieces(length, visit);
+			}
+
+			num_t readv(num_t offset, std::span<const std::span<byte_t>> buffers) {
+				return readLocked([&]() {
+					num_t done = 0;
+					for (auto& buffer : buffers) {
+						num_t count = inPieces(buffer.size(), [&](num_t at, num_t count) { return readUnlocked(offset + done + at, buffer.subspan(at, count)); });
+						done += count;
+						if (count < buffer.size())
+							break;
+					}
+					return done;
+				});
+			}
+
+			num_t writev(num_t offset, std::span<const std::span<const byte_t>> buffers) {
+				WriteGuard guard(this);
+				num_t total = 0;
+				for (auto& buffer : buffers)
+					total += buffer.size();
+				if (offset + total > size())
+					resizeFile(offset + total);
+				num_t done = 0;
+				for (auto& buffer : buffers)
+					done += inPieces(buffer.size(), [&](num_t at, num_t count) { return writeUnlocked(offset + done + at, buffer.subspan(at, count)); });
+				return done;
+			}
+
+		private:
+			// A cached instance takes a large transfer in pieces of a quarter of
+			// the cache and trims it between them, where the outermost operation
+			// holds no block reference, so one call cannot bring in the image.
+			template<typename Piece>
+			num_t inPieces(num_t length, Piece&& piece) {
+				Cache* cache = mem_inst->cache_.get();
+				num_t step = cache != nullptr && cache->depth == 1 ? std::max(BlockSize, cache->capacity * cache->unit / 4 / BlockSize * BlockSize) : length;
+				if (length <= step)
+					return piece(0, length);
+				num_t done = 0;
+				while (done < length) {
+					if (done != 0)
+						mem_inst->trimCache();
+					num_t count = std::min(step, length - done);
+					num_t res = piece(done, count);
+					done += res;
+					if (res < count)
+						break;
+				}
+				return done;
+			}
+
+			num_t readUnlocked(num_t offset, std::span<byte_t> buffer) {
+				num_t file_size = size();
+				if (offset >= file_size)
+					return 0;
+				num_t total = std::min<num_t>(buffer.size(), file_size - offset);
+				if (storage() != 0) {
+					if (offset + total > PackLimit)
+						throw new std::out_of_range("Small file overrun");
+					std::memcpy(buffer.data(), smallData() + offset, total);
+					return total;
+				}
+				num_t done = 0;
+				BlockCursor cursor(this);
+				while (done < total) {
+					num_t pos = offset + done;
+					num_t bindex = pos % BlockSize;
+					num_t chunk = std::min(BlockSize - bindex, total - done);
+					BlockType* block = cursor.block(pos / BlockSize);
+					if (block != nullptr)
+						std::memcpy(buffer.data() + done, block->data.data() + bindex, chunk);
+					else
+						std::memset(buffer.data() + done, 0, chunk);
+					done += chunk;
+				}
+				return total;
+			}
+
+			num_t writeUnlocked(num_t offset, std::span<const byte_t> buffer) {
+				num_t total = buffer.size();
+				if (offset + total > size())
+					resizeFile(offset + total);
+				if (total == 0)
+					return 0;
+				if (storage() != 0) {
+					std::memcpy(smallData() + offset, buffer.data(), total);
+					mem_inst->markDirty(smallData());
+					return total;
+				}
+				materializeRange(offset / BlockSize, (offset + total - 1) / BlockSize + 1);
+				unshareRange(offset / BlockSize, (offset + total - 1) / BlockSize + 1);
+				num_t done = 0;
+				BlockCursor cursor(this);
+				while (done < total) {
+					num_t pos = offset + done;
+					num_t bindex = pos % BlockSize;
+					num_t chunk = std::min(BlockSize - bindex, total - done);
+					BlockType* block = cursor.block(pos / BlockSize);
+					std::memcpy(block->data.data() + bindex, buffer.data() + done, chunk);
+					mem_inst->markDirty(block);
+					done += chunk;
+				}
+				return total;
+			}
+
+			template<typename Callback>
+			num_t forEachSpanUnlocked(num_t offset, num_t length, Callback& callback) {
+				auto emit = [&callback](std::span<const byte_t> span) {
+					if constexpr (std::is_same_v<std::invoke_result_t<Callback&, std::span<const byte_t>>, bool>)
+						return callback(span);
+					else {
+						callback(span);
+						return true;
+					}
+				};
+
+				num_t file_size = size();
+				if (offset >= file_size)
+					return 0;
+				num_t total = std::min(length, file_size - offset);
+				if (storage() != 0) {
+					emit({ smallData() + offset, total });
+					return total;
+				}
+				num_t done = 0;
+				const byte_t* span_begin = nullptr;
+				num_t span_size = 0;
+				BlockCursor cursor(this);
+				while (done < total) {
+					num_t pos = offset + done;
+					num_t bindex = pos % BlockSize;
+					num_t chunk = std::min(BlockSize - bindex, total - done);
+					BlockType* block = cursor.block(pos / BlockSize);
+					const byte_t* ptr = (block != nullptr ? block : &zero_block_)->data.data() + bindex;
+					if (span_size != 0 && span_begin + span_size != ptr) {
+						if (!emit({ span_begin, span_size }))
+							return done;
+						span_size = 0;
+					}
+					if (span_size == 0)
+						span_begin = ptr;
+					span_size += chunk;
+					done += chunk;
+				}
+				if (span_size != 0)
+					emit({ span_begin, span_size });
+				return total;
+			}
+
+		public:
+			MemoryInstance* instance() {
+				return mem_inst;
+			}
+
+			static FileReference fileAt(num_t index, MemoryInstance* src) {
+				FileReference res{};
+				res.index = index;
+				res.mem_inst = src;
+				return res;
+			}
+
+			// Creates a file in the first free descriptor.
+			static FileReference create(MemoryInstance* src, Primitives::Descriptor::FileHeader::Layout layout = Primitives::Descriptor::FileHeader::Indirect) {
+				FileReference res = fileAt(src->acquireDescriptor(), src);
+				WriteGuard guard(&res);
+				res.initFile(layout);
+				return res;
+			}
+
+			num_t getIndex() const {
+				return index;
+			}
+
+			// Creates an unnamed copy of this file in the first free descriptor. Both
+			// files share their blocks and pointer tree; either one copies a shared
+			// block the first time it writes to it.
+			FileReference clone() {
+				using FileHeader = Primitives::Descriptor::FileHeader;
+				FileReference res = fileAt(mem_inst->acquireDescriptor(), mem_inst);
+				PairGuard guard(this, &res);
+				if (!exsits() || isDirectory()) {
+					mem_inst->releaseDescriptor(res.index);
+					throw new std::invalid_argument("Only regular files can be cloned");
+				}
+
+				auto& source = descriptor();
+				auto& target = res.descriptor();
+				res.initFile(FileHeader::Indirect);
+				// Inline runs move into a leaf so that the clone shares one node.
+				if (extentMapped() && storage() == 0 && source.extents().tree_ptr == 0 && source.header.extent_count != 0) {
+					auto& ext = source.extents();
+					num_t leaf = mem_inst->allocateSingleBlock();
+					mem_inst->markBlockDirty(leaf, true);
+					auto& node = mem_inst->getExtentNode(leaf);
+					node.level = 0;
+					node.count = source.header.extent_count;
+					std::copy(ext.runs.begin(), ext.runs.begin() + node.count, node.extents.begin());
+					ext.tree_ptr = leaf;
+				}
+				target.header.size = source.header.size;
+				target.header.layout = source.header.layout & ~FileHeader::Linked;
+				target.header.extent_count = source.header.extent_count;
+				target.header.blocks = source.header.blocks;
+				target.data = source.data;
+
+				if (storage() == FileHeader::Packed) {
+					auto heap_file = heap();
+					target.data.extra[0] = heap_file.heapAllocate(size());
+					std::memcpy(heap_file.heapBytes(target.data.extra[0]), smallData(), HeapMinSlot << heapClass(size()));
+					mem_inst->markDirty(heap_file.heapBytes(target.data.extra[0]));
+				}
+				if (storage() != 0)
+					return res;
+
+				if (extentMapped()) {
+					if (num_t root = source.extents().tree_ptr; root != 0)
+						mem_inst->shareBlock(root);
+				}
+				else
+					for (num_t depth = 0; depth < 4; depth++)
+						if (num_t ptr = *rootPtr(source.data, depth); ptr != 0)
+							mem_inst->shareBlock(ptr);
+				source.header.layout |= FileHeader::Shared;
+				target.header.layout |= FileHeader::Shared;
+				return res;
+			}
+
+			void makeDirectory() {
+				WriteGuard guard(this);
+				if (!exsits())
+					throw new std::invalid_argument("File does not exist");
+				descriptor().attributes.flags |= descriptor().attributes.DR;
+				initDirectory(DirectoryInitialCapacity);
+			}
+
+			std::optional<FileReference> lookup(std::string_view name) {
+				num_t hash = hashName(name);
+				num_t child = readLocked([&]() -> num_t {
+					if (!isDirectory())
+						return 0;
+					num_t slot = findEntry(name, hash);
+					return slot != 0 ? directoryEntry(slot).descriptor : 0;
+				});
+				if (child == 0)
+					return std::nullopt;
+				return fileAt(child - 1, mem_inst);
+			}
+
+			// Adds file to this directory under name, which becomes the file's name.
+			void link(std::string_view name, FileReference& file) {
+				if (name.empty() || name.find('/') != std::string_view::npos)
+					throw new std::invalid_argument("Invalid file name");
+				PairGuard guard(this, &file);
+				if (!isDirectory())
+					throw new std::invalid_argument("Not a directory");
+				num_t hash = hashName(name);
+				if (findEntry(name, hash) != 0)
+					throw new std::invalid_argument("File already exists");
+				if (file.linked())
+					throw new std::invalid_argument("File is already linked");
+				file.setName(std::string(name));
+				auto& header = directoryEntry(0);
+				if ((header.hash + 1) * 4 > header.descriptor * 3)
+					growDirectory();
+				placeEntry(hash, file.index);
+				setEntry(0, { directoryEntry(0).hash + 1, directoryEntry(0).descriptor });
+				file.setLinked(true);
+			}
+
+			// The child is looked up first so that both stripes can be taken in
+			// order, and again under them in case it changed in between.
+			std::optional<FileReference> unlink(std::string_view name) {
+				num_t hash = hashName(name);
+				for (;;) {
+					std::optional<FileReference> child = lookup(name);
+					PairGuard guard(this, child ? &*child : this);
+					if (!isDirectory())
+						throw new std::invalid_argument("Not a directory");
+					num_t slot = findEntry(name, hash);
+					if ((slot != 0 ? directoryEntry(slot).descriptor : 0) != (child ? child->index + 1 : 0))
+						continue;
+					if (slot == 0)
+						return std::nullopt;
+					removeEntry(slot);
+					child->setLinked(false);
+					if (child->isDirectory())
+						mem_inst->clearDentries();
+					else
+						mem_inst->forgetDentry(index, name);
+					return child;
+				}
+			}
+
+			num_t entryCount() {
+				return isDirectory() ? directoryEntry(0).hash : 0;
+			}
+
+			std::vector<FileReference> entries() {
+				return readLocked([&]() {
+					std::vector<FileReference> res;
+					if (!isDirectory())
+						return res;
+					num_t capacity = directoryEntry(0).descriptor;
+					res.reserve(directoryEntry(0).hash);
+					for (num_t i = 1; i <= capacity; i++)
+						if (num_t child = directoryEntry(i).descriptor; child != 0)
+							res.push_back(fileAt(child - 1, mem_inst));
+					return res;
+				});
+			}
+
+			struct BlockCursor {
+			private:
+				constexpr const static num_t CacheSize = 8;
+				constexpr const static num_t PrefetchDistance = 4;
+
+				struct Leaf {
+					num_t base;
+					num_t span;
+					num_t* ptrs;
+				};
+
+				FileReference* ref_ptr_;
+				bool extents_;
+				Leaf current_{ 0, 0, nullptr };
+				array_type<Leaf, CacheSize> cache_{};
+				Primitives::MappedExtent extent_{ 0, 0, 0 };
+
+				Leaf resolveLeaf(num_t logical) {
+					MemoryInstance* inst = ref_ptr_->mem_inst;
+					auto& data = ref_ptr_->descriptor().data;
+					num_t base = 0;
+					for (num_t depth = 0; depth < 4; depth++) {
+						num_t capacity = CPower(PtrBlockType::Size, depth);
+						if (logical < base + capacity) {
+							if (depth == 0)
+								return { 0, Size0, &data.data_0_ptr };
+							num_t rel = logical - base;
+							num_t ptr = *rootPtr(data, depth);
+							for (num_t level = depth - 1; level > 0 && ptr != 0; level--)
+								ptr = inst->getPtrBlock(ptr).ptrs[(rel / CPower(PtrBlockType::Size, level)) % PtrBlockType::Size];
+							return { base + rel / PtrBlockType::Size * PtrBlockType::Size, PtrBlockType::Size, ptr != 0 ? inst->getPtrBlock(ptr).ptrs.data() : nullptr };
+						}
+						base += capacity;
+					}
+					throw new std::out_of_range("Unindexed block");
+				}
+
+				num_t mapExtent(num_t logical) {
+					if (logical - extent_.logical < extent_.length)
+						return extent_.physical + (logical - extent_.logical);
+					auto extent = ref_ptr_->mem_inst->getExtent(ref_ptr_->descriptor(), logical);
+					if (extent == nullptr)
+						return 0;
+					extent_ = *extent;
+					return extent_.physical + (logical - extent_.logical);
+				}
+
+			public:
+				BlockCursor(FileReference* file) : ref_ptr_(file), extents_(file->extentMapped()) {}
+
+				void invalidate() {
+					current_ = { 0, 0, nullptr };
+					cache_.fill({ 0, 0, nullptr });
+					extent_ = { 0, 0, 0 };
+				}
+
+				num_t map(num_t logical) {
+					if (extents_)
+						return mapExtent(logical);
+					if (logical - current_.base < current_.span)
+						return current_.ptrs[logical - current_.base];
+
+					if (logical < Size0) {
+						current_ = resolveLeaf(logical);
+						return current_.ptrs[logical];
+					}
+
+					// Leaves past the direct pointers start at Size0, so key on the leaf index.
+					auto& slot = cache_[(logical - Size0) / PtrBlockType::Size % CacheSize];
+					if (!(logical - slot.base < slot.span)) {
+						Leaf leaf = resolveLeaf(logical);
+						if (leaf.ptrs == nullptr)
+							return 0;
+						slot = leaf;
+					}
+					current_ = slot;
+					return current_.ptrs[logical - current_.base];
+				}
+
+				BlockType* block(num_t logical) {
+					num_t ptr = map(logical);
+					num_t ahead = logical + PrefetchDistance;
+					if (extents_) {
+						if (ahead - extent_.logical < extent_.length)
+							prefetch(ref_ptr_->mem_inst->blockAddress(extent_.physical + (ahead - extent_.logical)));
+					}
+					else if (ahead - current_.base < current_.span && current_.ptrs[ahead - current_.base] != 0)
+						prefetch(ref_ptr_->mem_inst->blockAddress(current_.ptrs[ahead - current_.base]));
+					return ptr != 0 ? &ref_ptr_->mem_inst->getBlock(ptr) : nullptr;
+				}
+			};
+
+			template<typename Type>
+			struct DataIterator {
+			private:
+				FileReference* ref_ptr_;
+				num_t index_;
+				num_t offest_;
+
+			public:
+				DataIterator(FileReference* file, num_t index = 0, num_t byte_offest = 0) : ref_ptr_(file), index_(index), offest_(byte_offest) {}
+
+				void set(const Type& a) {
+					const auto& data = reinterpret_cast<const std::array<byte_t, sizeof(Type)>&>(a);
+					ref_ptr_->write(offest_ + index_ * sizeof(Type), data);
+				}
+
+				Type operator*() {
+					std::array<byte_t, sizeof(Type)> data;
+					num_t size = sizeof(Type);
+					num_t index = 0;
+					num_t offest = offest_ + index_ * sizeof(Type);
+					num_t bindex = offest % BlockSize;
+
+					if (ref_ptr_->storage() != 0) {
+						data.fill(0);
+						ref_ptr_->read(offest, data);
+						index = size;
+					}
+
+					BlockType* block;
+
+					while (index < size) {
+						num_t ptr = ref_ptr_->mem_inst->getIndexedPtr(ref_ptr_->index, (offest + index) / BlockSize);
+						block = ptr != 0 ? &ref_ptr_->mem_inst->getBlock(ptr) : &zero_block_;
+						for (; bindex < BlockSize && index < size; bindex++, index++)
+							data[index] = block->data[bindex];
+						bindex = 0;
+					}
+
+					Type res;
+					std::memcpy(&res, data.data(), sizeof(Type));
+					return res;
+				}
+
+				DataIterator& operator++() {
+					index_++;
+					return *this;
+				}
+
+				bool operator!=(const DataIterator& other) {
+					return index_ * sizeof(Type) + offest_ != other.index_ * sizeof(Type) + other.offest_;
+				}
+			};
+		};
+
+		struct API;
+	};
+
+	template<num_t BlockSize, num_t SuperBlockSize, num_t SuperBlockCount, num_t DescriptorCount, num_t DataAlignment>
+	struct MemoryInstance<BlockSize, SuperBlockSize, SuperBlockCount, DescriptorCount, DataAlignment>::API {
+		// Every live file except the root directory and the string heap.
+		static std::vector<FileReference> ListFiles(MemoryInstance* inst) {
+			std::vector<FileReference> res;
+			res.reserve(inst->fileCount());
+			for (num_t w = 0; w < DescriptorWords; w++)
+				for (num_t word = inst->live_descriptors_[w]; word != 0; word &= word - 1)
+					if (num_t index = (w << 6) | std::countr_zero(word); !inst->systemDescriptor(index))
+						res.push_back(FileReference::fileAt(index, inst));
+			return res;
+		}
+		static std::vector<FileReference> OpenDirectory(FileReference ref) {
+			return ref.entries();
+		}
+
+		// The root directory is created on first use.
+		static FileReference Root(MemoryInstance* inst) {
+			std::atomic_ref<num_t> root(inst->getHeader().root_descriptor);
+			num_t current = root.load(std::memory_order_acquire);
+			if (current != 0)
+				return FileReference::fileAt(current - 1, inst);
+			auto dir = FileReference::create(inst);
+			dir.makeDirectory();
+			if (!root.compare_exchange_strong(current, dir.getIndex() + 1, std::memory_order_acq_rel)) {
+				dir.deletFile();
+				return FileReference::fileAt(current - 1, inst);
+			}
+			return dir;
+		}
+
+		static FileReference CreateFile(FileReference parent, std::string_view name, Primitives::Descriptor::FileHeader::Layout layout = Primitives::Descriptor::FileHeader::Indirect) {
+			auto file = FileReference::create(parent.instance(), layout);
+			try {
+				parent.link(name, file);
+			}
+			catch (std::exception*) {
+				file.deletFile();
+				throw;
+			}
+			return file;
+		}
+
+		static FileReference CloneFile(FileReference parent, FileReference source, std::string_view name) {
+			auto file = source.clone();
+			try {
+				parent.link(name, file);
+			}
+			catch (std::exception*) {
+				file.deletFile();
+				throw;
+			}
+			return file;
+		}
+
+		static FileReference CreateDirectory(FileReference parent, std::string_view name) {
+			auto dir = FileReference::create(parent.instance());
+			try {
+				dir.makeDirectory();
+				parent.link(name, dir);
+			}
+			catch (std::exception*) {
+				dir.deletFile();
+				throw;
+			}
+			return dir;
+		}
+
+		// Resolves a '/'-separated path from the root directory, consulting the
+		// dentry cache for each component before probing the directory itself.
+		static std::optional<FileReference> Resolve(MemoryInstance* inst, std::string_view path) {
+			FileReference current = Root(inst);
+			while (!path.empty()) {
+				size_t split = path.find('/');
+				std::string_view name = path.substr(0, split);
+				path = split == std::string_view::npos ? std::string_view{} : path.substr(split + 1);
+				if (name.empty() || name == ".")
+					continue;
+				if (num_t child = inst->cachedDentry(current.getIndex(), name); child != 0) {
+					current = FileReference::fileAt(child - 1, inst);
+					continue;
+				}
+				auto found = current.lookup(name);
+				if (!found)
+					return std::nullopt;
+				inst->cacheDentry(current.getIndex(), name, found->getIndex());
+				current = *found;
+			}
+			return current;
 		}
 	};
 }
\ No newline at end of file
@@ -0,0 +1,973 @@
+#pragma once
+#include "fsheaders.hpp"
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
+#endif
+#endif
+
+namespace TTFileSystem
+{
+	namespace Platform
+	{
+		// A file mapped over capacity bytes of address space, of which the first
+		// size are backed by the file.
+		struct MappedFile
+		{
+			byte_t* data = nullptr;
+			num_t size = 0;
+			num_t capacity = 0;
+#ifdef _WIN32
+			HANDLE file = INVALID_HANDLE_VALUE;
+			HANDLE mapping = nullptr;
+#else
+			int file = -1;
+#endif
+		};
+
+		inline num_t pageSize() {
+#ifdef _WIN32
+			SYSTEM_INFO info;
+			GetSystemInfo(&info);
+			return info.dwPageSize;
+#else
+			return (num_t)sysconf(_SC_PAGESIZE);
+#endif
+		}
+
+		// How new heap instances back their memory. Huge asks for reserved huge
+		// pages and falls back to transparent ones. Placement spreads pages over
+		// the NUMA nodes in node_mask, all nodes with memory when it is 0; Bind
+		// gives every node its own run of superblocks. Placement is only
+		// honoured on Linux.
+		struct MemoryPolicy {
+			enum Pages { Default, Transparent, Huge };
+			enum Placement { Local, Interleave, Bind };
+
+			Pages pages = Default;
+			Placement placement = Local;
+			num_t node_mask = 0;
+		};
+
+		constexpr const num_t HugePageSize = 2 << 20;
+
+		// NUMA nodes with memory as a bit mask; node 0 alone where unknown.
+		inline num_t memoryNodes() {
+			num_t res = 0;
+#ifdef __linux__
+			if (std::FILE* file = std::fopen("/sys/devices/system/node/has_memory", "r")) {
+				unsigned first, last;
+				while (std::fscanf(file, "%u", &first) == 1) {
+					last = first;
+					int separator = std::fgetc(file);
+					if (separator == '-' && std::fscanf(file, "%u", &last) == 1)
+						separator = std::fgetc(file);
+					for (; first <= last && first < 64; first++)
+						res |= 1ULL << first;
+					if (separator != ',')
+						break;
+				}
+				std::fclose(file);
+			}
+#endif
+			return res != 0 ? res : 1;
+		}
+
+		// Interleaves the pages of a range over the nodes in node_mask or, with
+		// bind, keeps them on those nodes. A hint: failures are ignored.
+		inline void placeMemory(byte_t* data, num_t size, num_t node_mask, bool bind) {
+#ifdef __linux__
+			byte_t* start = data - (num_t)data % pageSize();
+			unsigned long mask = node_mask != 0 ? node_mask : memoryNodes();
+			syscall(SYS_mbind, start, size + (data - start), bind ? MPOL_BIND : MPOL_INTERLEAVE, &mask, 65, 0);
+#endif
+		}
+
+		// Anonymous memory backed as policy says, starting on an alignment
+		// boundary and, with huge pages, on a HugePageSize one. Release it with
+		// freeMemory and the same size.
+		inline byte_t* allocateMemory(num_t size, num_t alignment, const MemoryPolicy& policy) {
+			size = (size + HugePageSize - 1) / HugePageSize * HugePageSize;
+#ifdef _WIN32
+			void* ptr = nullptr;
+			if (policy.pages == MemoryPolicy::Huge && GetLargePageMinimum() != 0 && size % GetLargePageMinimum() == 0)
+				ptr = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (ptr == nullptr)
+				ptr = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+			if (ptr == nullptr)
+				throw new std::bad_alloc();
+			return (byte_t*)ptr;
+#else
+			void* ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+			if (policy.pages == MemoryPolicy::Huge)
+				ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+			if (ptr == MAP_FAILED) {
+				// Maps extra so the range can start on the boundary.
+				num_t align = std::max(alignment, policy.pages != MemoryPolicy::Default ? HugePageSize : pageSize());
+				byte_t* raw = (byte_t*)mmap(nullptr, size + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+				if (raw == MAP_FAILED)
+					throw new std::bad_alloc();
+				byte_t* start = raw + (align - (num_t)raw % align) % align;
+				if (start != raw)
+					munmap(raw, start - raw);
+				munmap(start + size, raw + align - start);
+				ptr = start;
+#ifdef MADV_HUGEPAGE
+				if (policy.pages != MemoryPolicy::Default)
+					madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+			}
+			if (policy.placement == MemoryPolicy::Interleave)
+				placeMemory((byte_t*)ptr, size, policy.node_mask, false);
+			return (byte_t*)ptr;
+#endif
+		}
+
+		inline void freeMemory(byte_t* data, num_t size) {
+#ifdef _WIN32
+			VirtualFree(data, 0, MEM_RELEASE);
+#else
+			munmap(data, (size + HugePageSize - 1) / HugePageSize * HugePageSize);
+#endif
+		}
+
+		// Zeroed memory whose pages are only backed once touched.
+		inline byte_t* reserveMemory(num_t size) {
+#ifdef _WIN32
+			void* ptr = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+			if (ptr == nullptr)
+				throw new std::bad_alloc();
+#else
+			void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (ptr == MAP_FAILED)
+				throw new std::bad_alloc();
+#endif
+			return (byte_t*)ptr;
+		}
+
+		inline void releaseMemory(byte_t* data, num_t size) {
+#ifdef _WIN32
+			VirtualFree(data, 0, MEM_RELEASE);
+#else
+			munmap(data, size);
+#endif
+		}
+
+		// Hands the pages of a page-aligned range of reserved memory back to the
+		// system; their contents are lost.
+		inline void discardMemory(byte_t* data, num_t size) {
+#ifdef _WIN32
+			VirtualAlloc(data, size, MEM_RESET, PAGE_READWRITE);
+#else
+			madvise(data, size, MADV_DONTNEED);
+#endif
+		}
+
+		// Frees the storage behind a range of a mapped image, which then reads as
+		// zeros; false where the filesystem cannot.
+		inline bool punchHole(MappedFile& file, num_t offset, num_t length) {
+#ifdef _WIN32
+			FILE_ZERO_DATA_INFORMATION range;
+			range.FileOffset.QuadPart = offset;
+			range.BeyondFinalZero.QuadPart = offset + length;
+			DWORD returned = 0;
+			return DeviceIoControl(file.file, FSCTL_SET_ZERO_DATA, &range, sizeof(range), nullptr, 0, &returned, nullptr) != 0;
+#elif defined(FALLOC_FL_PUNCH_HOLE)
+			return fallocate(file.file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0;
+#else
+			return false;
+#endif
+		}
+
+		inline void unmapFile(MappedFile& file) {
+#ifdef _WIN32
+			if (file.data != nullptr)
+				UnmapViewOfFile(file.data);
+			if (file.mapping != nullptr)
+				CloseHandle(file.mapping);
+			if (file.file != INVALID_HANDLE_VALUE)
+				CloseHandle(file.file);
+			file.mapping = nullptr;
+			file.file = INVALID_HANDLE_VALUE;
+#else
+			if (file.data != nullptr)
+				munmap(file.data, file.capacity);
+			if (file.file != -1)
+				close(file.file);
+			file.file = -1;
+#endif
+			file.data = nullptr;
+			file.size = 0;
+			file.capacity = 0;
+		}
+
+		// Maps the whole file read-write. With create set the file is truncated to
+		// size bytes; otherwise size is taken from the existing file. A private
+		// mapping never writes changes back to the file. The mapping reserves
+		// capacity bytes when that is more, so the file can grow in place with
+		// growMapping. Windows cannot map past the end of a file, so there the
+		// file is made sparse and spans the whole capacity from the start.
+		inline MappedFile mapFile(const char* path, num_t size, bool create, bool shared = true, num_t capacity = 0) {
+			MappedFile res;
+#ifdef _WIN32
+			res.file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (res.file == INVALID_HANDLE_VALUE)
+				throw new std::runtime_error("Unable to open image file");
+			if (!create) {
+				LARGE_INTEGER file_size;
+				GetFileSizeEx(res.file, &file_size);
+				size = file_size.QuadPart;
+			}
+			res.size = size;
+			res.capacity = std::max(size, capacity);
+			if (res.capacity > size) {
+				DWORD returned = 0;
+				DeviceIoControl(res.file, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &returned, nullptr);
+			}
+			res.mapping = CreateFileMappingA(res.file, nullptr, shared ? PAGE_READWRITE : PAGE_WRITECOPY, (DWORD)(res.capacity >> 32), (DWORD)res.capacity, nullptr);
+			if (res.mapping != nullptr)
+				res.data = (byte_t*)MapViewOfFile(res.mapping, shared ? FILE_MAP_ALL_ACCESS : FILE_MAP_COPY, 0, 0, res.capacity);
+			if (res.data == nullptr) {
+				unmapFile(res);
+				throw new std::runtime_error("Unable to map image file");
+			}
+#else
+			res.file = open(path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644);
+			if (res.file == -1)
+				throw new std::runtime_error("Unable to open image file");
+			if (create) {
+				if (ftruncate(res.file, size) != 0) {
+					unmapFile(res);
+					throw new std::runtime_error("Unable to resize image file");
+				}
+			}
+			else {
+				struct stat st;
+				fstat(res.file, &st);
+				size = st.st_size;
+			}
+			res.size = size;
+			res.capacity = std::max(size, capacity);
+			void* ptr = res.capacity == 0 ? MAP_FAILED : mmap(nullptr, res.capacity, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, res.file, 0);
+			if (ptr == MAP_FAILED) {
+				unmapFile(res);
+				throw new std::runtime_error("Unable to map image file");
+			}
+			res.data = (byte_t*)ptr;
+#endif
+			return res;
+		}
+
+		// Extends the file behind a mapping to size bytes, which must stay within
+		// its capacity. The mapping does not move.
+		inline void growMapping(MappedFile& file, num_t size) {
+			if (size > file.capacity)
+				throw new std::invalid_argument("Mapping capacity exceeded");
+			if (size <= file.size)
+				return;
+#ifndef _WIN32
+			if (ftruncate(file.file, size) != 0)
+				throw new std::runtime_error("Unable to resize image file");
+#endif
+			file.size = size;
+		}
+
+		// Writes size bytes of data to a new file at path. When source is the
+		// image mapping holding them the filesystem copies the file instead,
+		// sharing its extents where reflinks are supported. Without data the
+		// source file alone is copied.
+		inline void copyImage(const char* path, const MappedFile* source, const byte_t* data, num_t size) {
+			num_t done = 0;
+			std::vector<byte_t> chunk(data == nullptr ? 1 << 20 : 0);
+#ifdef _WIN32
+			HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (file == INVALID_HANDLE_VALUE)
+				throw new std::runtime_error("Unable to open image file");
+			while (done < size) {
+				const byte_t* bytes = data != nullptr ? data + done : chunk.data();
+				DWORD length = (DWORD)std::min<num_t>(size - done, 1 << 30);
+				if (data == nullptr) {
+					OVERLAPPED position{};
+					position.Offset = (DWORD)done;
+					position.OffsetHigh = (DWORD)(done >> 32);
+					if (!ReadFile(source->file, chunk.data(), (DWORD)std::min<num_t>(size - done, chunk.size()), &length, &position) || length == 0) {
+						CloseHandle(file);
+						throw new std::runtime_error("Unable to read image file");
+					}
+				}
+				DWORD written = 0;
+				if (!WriteFile(file, bytes, length, &written, nullptr) || written == 0) {
+					CloseHandle(file);
+					throw new std::runtime_error("Unable to write image file");
+				}
+				done += written;
+			}
+			CloseHandle(file);
+#else
+			int file = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+			if (file == -1)
+				throw new std::runtime_error("Unable to open image file");
+#ifdef __linux__
+			if (source != nullptr && ioctl(file, FICLONE, source->file) == 0)
+				done = size;
+			for (ssize_t copied; source != nullptr && done < size; done += copied) {
+				loff_t in = done, out = done;
+				if ((copied = copy_file_range(source->file, &in, file, &out, size - done, 0)) <= 0)
+					break;
+			}
+#endif
+			for (ssize_t written; done < size; done += written) {
+				const byte_t* bytes = data != nullptr ? data + done : chunk.data();
+				ssize_t length = size - done;
+				if (data == nullptr) {
+					if ((length = pread(source->file, chunk.data(), std::min<num_t>(size - done, chunk.size()), done)) <= 0) {
+						close(file);
+						throw new std::runtime_error("Unable to read image file");
+					}
+				}
+				if ((written = pwrite(file, bytes, length, done)) <= 0) {
+					close(file);
+					throw new std::runtime_error("Unable to write image file");
+				}
+			}
+			close(file);
+#endif
+		}
+
+		struct FileHandle
+		{
+#ifdef _WIN32
+			HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+			int handle = -1;
+#endif
+		};
+
+		// Opens a file for sequential access. With create set a missing file is
+		// created and an existing one truncated unless keep is set; otherwise the
+		// file must exist.
+		inline FileHandle openFile(const char* path, bool create, bool keep = false) {
+			FileHandle res;
+#ifdef _WIN32
+			res.handle = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, !create ? OPEN_EXISTING : keep ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (res.handle == INVALID_HANDLE_VALUE)
+				throw new std::runtime_error("Unable to open file");
+#else
+			res.handle = open(path, O_RDWR | (create ? O_CREAT : 0) | (create && !keep ? O_TRUNC : 0), 0644);
+			if (res.handle == -1)
+				throw new std::runtime_error("Unable to open file");
+#endif
+			return res;
+		}
+
+		inline void closeFile(FileHandle& file) {
+#ifdef _WIN32
+			if (file.handle != INVALID_HANDLE_VALUE)
+				CloseHandle(file.handle);
+			file.handle = INVALID_HANDLE_VALUE;
+#else
+			if (file.handle != -1)
+				close(file.handle);
+			file.handle = -1;
+#endif
+		}
+
+		inline void writeFile(FileHandle& file, const void* data, num_t size) {
+			auto bytes = static_cast<const byte_t*>(data);
+			for (num_t done = 0; done < size;) {
+#ifdef _WIN32
+				DWORD written = 0;
+				if (!WriteFile(file.handle, bytes + done, (DWORD)std::min<num_t>(size - done, 1 << 30), &written, nullptr) || written == 0)
+					throw new std::runtime_error("Unable to write file");
+#else
+				ssize_t written = write(file.handle, bytes + done, size - done);
+				if (written <= 0)
+					throw new std::runtime_error("Unable to write file");
+#endif
+				done += written;
+			}
+		}
+
+		// Reads exactly size bytes; running into the end of the file is an error.
+		inline void readFile(FileHandle& file, void* data, num_t size) {
+			auto bytes = static_cast<byte_t*>(data);
+			for (num_t done = 0; done < size;) {
+#ifdef _WIN32
+				DWORD read = 0;
+				if (!ReadFile(file.handle, bytes + done, (DWORD)std::min<num_t>(size - done, 1 << 30), &read, nullptr) || read == 0)
+					throw new std::runtime_error("Unable to read file");
+#else
+				ssize_t read = ::read(file.handle, bytes + done, size - done);
+				if (read <= 0)
+					throw new std::runtime_error("Unable to read file");
+#endif
+				done += read;
+			}
+		}
+
+		inline void writeFileAt(FileHandle& file, num_t offset, const void* data, num_t size) {
+			auto bytes = static_cast<const byte_t*>(data);
+			for (num_t done = 0; done < size;) {
+#ifdef _WIN32
+				OVERLAPPED position{};
+				position.Offset = (DWORD)(offset + done);
+				position.OffsetHigh = (DWORD)((offset + done) >> 32);
+				DWORD written = 0;
+				if (!WriteFile(file.handle, bytes + done, (DWORD)std::min<num_t>(size - done, 1 << 30), &written, &position) || written == 0)
+					throw new std::runtime_error("Unable to write file");
+#else
+				ssize_t written = pwrite(file.handle, bytes + done, size - done, offset + done);
+				if (written <= 0)
+					throw new std::runtime_error("Unable to write file");
+#endif
+				done += written;
+			}
+		}
+
+		inline void readFileAt(FileHandle& file, num_t offset, void* data, num_t size) {
+			auto bytes = static_cast<byte_t*>(data);
+			for (num_t done = 0; done < size;) {
+#ifdef _WIN32
+				OVERLAPPED position{};
+				position.Offset = (DWORD)(offset + done);
+				position.OffsetHigh = (DWORD)((offset + done) >> 32);
+				DWORD read = 0;
+				if (!ReadFile(file.handle, bytes + done, (DWORD)std::min<num_t>(size - done, 1 << 30), &read, &position) || read == 0)
+					throw new std::runtime_error("Unable to read file");
+#else
+				ssize_t read = pread(file.handle, bytes + done, size - done, offset + done);
+				if (read <= 0)
+					throw new std::runtime_error("Unable to read file");
+#endif
+				done += read;
+			}
+		}
+
+		inline num_t fileSize(FileHandle& file) {
+#ifdef _WIN32
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(file.handle, &size))
+				throw new std::runtime_error("Unable to query file");
+			return size.QuadPart;
+#else
+			struct stat st;
+			if (fstat(file.handle, &st) != 0)
+				throw new std::runtime_error("Unable to query file");
+			return st.st_size;
+#endif
+		}
+
+		inline void truncateFile(FileHandle& file, num_t size) {
+#ifdef _WIN32
+			LARGE_INTEGER position;
+			position.QuadPart = size;
+			if (!SetFilePointerEx(file.handle, position, nullptr, FILE_BEGIN) || !SetEndOfFile(file.handle))
+#else
+			if (ftruncate(file.handle, size) != 0)
+#endif
+				throw new std::runtime_error("Unable to resize file");
+		}
+
+		inline void syncFile(FileHandle& file) {
+#ifdef _WIN32
+			if (!FlushFileBuffers(file.handle))
+#else
+			if (fsync(file.handle) != 0)
+#endif
+				throw new std::runtime_error("Unable to flush file");
+		}
+
+		inline void syncRange(MappedFile& file, num_t offset, num_t length, bool wait = true) {
+			num_t page = pageSize();
+			num_t begin = offset / page * page;
+			length = std::min(offset + length, file.size) - begin;
+#ifdef _WIN32
+			if (!FlushViewOfFile(file.data + begin, length))
+				throw new std::runtime_error("Unable to flush image file");
+			if (wait)
+				FlushFileBuffers(file.file);
+#else
+			if (msync(file.data + begin, length, wait ? MS_SYNC : MS_ASYNC) != 0)
+				throw new std::runtime_error("Unable to flush image file");
+#endif
+		}
+
+		// Positional reads and writes against one file, submitted in batches and
+		// completed off the calling thread. On Linux they go through an io_uring,
+		// as fixed-buffer operations where they fall inside the registered
+		// buffer; elsewhere, or when no ring can be set up, a small thread pool
+		// issues them. The file must stay open while the engine lives.
+		struct AsyncIO
+		{
+		public:
+			struct Request {
+				num_t offset;
+				byte_t* data;
+				num_t length;
+			};
+
+			// Runs once per batch on an I/O thread, with whether every request and
+			// the trailing sync succeeded; it must not wait for the engine.
+			using Callback = std::function<void(bool)>;
+
+			constexpr static const num_t RingEntries = 256;
+			constexpr static const num_t MaxTransfer = 1 << 30;
+
+			// Without use_ring the thread pool is used even where a ring is offered.
+			AsyncIO(FileHandle file, byte_t* buffer = nullptr, num_t buffer_size = 0, bool use_ring = true, num_t threads = 4) : file_(file), buffer_(buffer), buffer_size_(buffer_size) {
+#ifdef __linux__
+				if (use_ring && setupRing())
+					return;
+#endif
+				for (num_t i = 0; i < std::max<num_t>(threads, 1); i++)
+					workers_.emplace_back([this] { work(); });
+			}
+
+			AsyncIO(const AsyncIO&) = delete;
+			AsyncIO& operator=(const AsyncIO&) = delete;
+
+			~AsyncIO() {
+				drain();
+#ifdef __linux__
+				if (ring_fd_ != -1) {
+					{
+						std::lock_guard guard(submit_mutex_);
+						stopping_ = true;
+						wake();
+					}
+					reaper_.join();
+					closeRing();
+					return;
+				}
+#endif
+				{
+					std::lock_guard guard(queue_mutex_);
+					stop_ = true;
+				}
+				queue_cv_.notify_all();
+				for (auto& worker : workers_)
+					worker.join();
+			}
+
+			bool ring() const {
+#ifdef __linux__
+				return ring_fd_ != -1;
+#else
+				return false;
+#endif
+			}
+
+			// Queues the requests as one batch; with sync set the file is flushed
+			// once they have all succeeded. Requests of a batch may run in any
+			// order and must not overlap.
+			void submit(std::vector<Request> requests, bool write, bool sync, Callback done) {
+				auto batch = std::make_shared<Batch>();
+				batch->requests = std::move(requests);
+				batch->write = write;
+				batch->sync = sync;
+				batch->done = std::move(done);
+				batch->remaining = batch->requests.size();
+				{
+					std::lock_guard guard(drain_mutex_);
+					batches_++;
+				}
+				if (batch->requests.empty()) {
+					if (sync)
+						issue(batch, 0);
+					else
+						finish(batch);
+					return;
+				}
+#ifdef __linux__
+				if (ring_fd_ != -1) {
+					std::lock_guard guard(submit_mutex_);
+					for (num_t i = 0; i < batch->requests.size(); i++)
+						backlog_.push_back(new Operation{ batch, i, 0 });
+					wake();
+					return;
+				}
+#endif
+				{
+					std::lock_guard guard(queue_mutex_);
+					for (num_t i = 0; i < batch->requests.size(); i++)
+						queue_.push_back({ batch, i, 0 });
+				}
+				queue_cv_.notify_all();
+			}
+
+			// Same as above; the future throws std::runtime_error* on failure.
+			std::future<void> submit(std::vector<Request> requests, bool write, bool sync = false) {
+				auto promise = std::make_shared<std::promise<void>>();
+				auto res = promise->get_future();
+				submit(std::move(requests), write, sync, [promise, write](bool ok) {
+					if (ok)
+						promise->set_value();
+					else
+						promise->set_exception(std::make_exception_ptr(new std::runtime_error(write ? "Unable to write file" : "Unable to read file")));
+				});
+				return res;
+			}
+
+			// Waits for every batch submitted so far. Returns false if any batch
+			// failed since the previous drain.
+			bool drain() {
+				std::unique_lock guard(drain_mutex_);
+				drain_cv_.wait(guard, [this] { return batches_ == 0; });
+				bool ok = !failed_;
+				failed_ = false;
+				return ok;
+			}
+
+		private:
+			struct Batch {
+				std::vector<Request> requests;
+				bool write = false;
+				bool sync = false;
+				Callback done;
+				std::atomic<num_t> remaining{ 0 };
+				std::atomic<bool> ok{ true };
+			};
+
+			// One request, or the sync of a batch when index is past its requests.
+			struct Operation {
+				std::shared_ptr<Batch> batch;
+				num_t index;
+				num_t done;
+			};
+
+			FileHandle file_;
+			byte_t* buffer_;
+			num_t buffer_size_;
+
+			std::mutex drain_mutex_;
+			std::condition_variable drain_cv_;
+			num_t batches_ = 0;
+			bool failed_ = false;
+
+			std::mutex queue_mutex_;
+			std::condition_variable queue_cv_;
+			std::deque<Operation> queue_;
+			bool stop_ = false;
+			std::vector<std::thread> workers_;
+
+			void finish(const std::shared_ptr<Batch>& batch) {
+				bool ok = batch->ok.load();
+				if (batch->done)
+					batch->done(ok);
+				{
+					std::lock_guard guard(drain_mutex_);
+					failed_ |= !ok;
+					batches_--;
+				}
+				drain_cv_.notify_all();
+			}
+
+			// Called when a request finished; returns true if the batch still
+			// needs its sync.
+			bool complete(const std::shared_ptr<Batch>& batch, bool ok) {
+				if (!ok)
+					batch->ok = false;
+				if (batch->remaining.fetch_sub(1) != 1)
+					return false;
+				if (batch->sync && batch->ok)
+					return true;
+				finish(batch);
+				return false;
+			}
+
+			void issue(const std::shared_ptr<Batch>& batch, num_t index) {
+#ifdef __linux__
+				if (ring_fd_ != -1) {
+					std::lock_guard guard(submit_mutex_);
+					backlog_.push_back(new Operation{ batch, index, 0 });
+					wake();
+					return;
+				}
+#endif
+				{
+					std::lock_guard guard(queue_mutex_);
+					queue_.push_back({ batch, index, 0 });
+				}
+				queue_cv_.notify_one();
+			}
+
+			void work() {
+				std::unique_lock guard(queue_mutex_);
+				while (true) {
+					queue_cv_.wait(guard, [this] { return stop_ || !queue_.empty(); });
+					if (queue_.empty())
+						return;
+					auto operation = std::move(queue_.front());
+					queue_.pop_front();
+					guard.unlock();
+					auto& batch = operation.batch;
+					bool ok = true;
+					try {
+						if (operation.index == batch->requests.size())
+							syncFile(file_);
+						else if (auto& request = batch->requests[operation.index]; batch->write)
+							writeFileAt(file_, request.offset, request.data, request.length);
+						else
+							readFileAt(file_, request.offset, request.data, request.length);
+					}
+					catch (std::exception* e) {
+						delete e;
+						ok = false;
+					}
+					if (operation.index == batch->requests.size()) {
+						batch->ok = batch->ok.load() && ok;
+						finish(batch);
+					}
+					else if (complete(batch, ok))
+						issue(batch, batch->requests.size());
+					guard.lock();
+				}
+			}
+
+#ifdef __linux__
+			int ring_fd_ = -1;
+			byte_t* sq_ring_ = nullptr;
+			byte_t* cq_ring_ = nullptr;
+			size_t sq_ring_size_ = 0;
+			size_t cq_ring_size_ = 0;
+			io_uring_sqe* sqes_ = nullptr;
+			size_t sqes_size_ = 0;
+			unsigned* sq_tail_ = nullptr;
+			unsigned* sq_mask_ = nullptr;
+			unsigned* sq_array_ = nullptr;
+			unsigned* cq_head_ = nullptr;
+			unsigned* cq_tail_ = nullptr;
+			unsigned* cq_mask_ = nullptr;
+			io_uring_cqe* cqes_ = nullptr;
+			unsigned sq_entries_ = 0;
+			bool registered_ = false;
+
+			// Only the reaper submits I/O, as the kernel cancels work queued by a
+			// thread that exits. Callers backlog operations and wake it with a
+			// no-op, which completes without any such work. Operations in the ring
+			// are capped at its size so completions never overflow.
+			std::mutex submit_mutex_;
+			num_t in_flight_ = 0;
+			std::deque<Operation*> backlog_;
+			bool waking_ = false;
+			bool stopping_ = false;
+			std::thread reaper_;
+
+			bool setupRing() {
+				io_uring_params params{};
+				ring_fd_ = (int)syscall(__NR_io_uring_setup, (unsigned)RingEntries, &params);
+				if (ring_fd_ < 0) {
+					ring_fd_ = -1;
+					return false;
+				}
+				sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+				cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+				bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+				if (single)
+					sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+				sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+				void* sq = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+				void* cq = single ? sq : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+				void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+				sq_ring_ = sq == MAP_FAILED ? nullptr : (byte_t*)sq;
+				cq_ring_ = cq == MAP_FAILED ? nullptr : (byte_t*)cq;
+				sqes_ = sqes == MAP_FAILED ? nullptr : (io_uring_sqe*)sqes;
+				if (sq_ring_ == nullptr || cq_ring_ == nullptr || sqes_ == nullptr) {
+					closeRing();
+					return false;
+				}
+				sq_tail_ = (unsigned*)(sq_ring_ + params.sq_off.tail);
+				sq_mask_ = (unsigned*)(sq_ring_ + params.sq_off.ring_mask);
+				sq_array_ = (unsigned*)(sq_ring_ + params.sq_off.array);
+				cq_head_ = (unsigned*)(cq_ring_ + params.cq_off.head);
+				cq_tail_ = (unsigned*)(cq_ring_ + params.cq_off.tail);
+				cq_mask_ = (unsigned*)(cq_ring_ + params.cq_off.ring_mask);
+				cqes_ = (io_uring_cqe*)(cq_ring_ + params.cq_off.cqes);
+				sq_entries_ = params.sq_entries;
+
+				// Pinning the buffer spares the kernel mapping it on every request;
+				// without it requests still work as plain reads and writes.
+				std::vector<iovec> buffers;
+				for (num_t offset = 0; buffer_ != nullptr && offset < buffer_size_; offset += MaxTransfer)
+					buffers.push_back({ buffer_ + offset, (size_t)std::min<num_t>(buffer_size_ - offset, MaxTransfer) });
+				registered_ = !buffers.empty() && syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS, buffers.data(), (unsigned)buffers.size()) == 0;
+				reaper_ = std::thread([this] { reap(); });
+				return true;
+			}
+
+			void closeRing() {
+				if (sqes_ != nullptr)
+					munmap(sqes_, sqes_size_);
+				if (cq_ring_ != nullptr && cq_ring_ != sq_ring_)
+					munmap(cq_ring_, cq_ring_size_);
+				if (sq_ring_ != nullptr)
+					munmap(sq_ring_, sq_ring_size_);
+				close(ring_fd_);
+				ring_fd_ = -1;
+			}
+
+			// Called with submit_mutex_ held.
+			void wake() {
+				if (waking_)
+					return;
+				waking_ = true;
+				push(nullptr);
+				enter(1);
+			}
+
+			// Moves backlogged operations into free slots; called by the reaper.
+			void pump() {
+				std::lock_guard guard(submit_mutex_);
+				unsigned count = 0;
+				for (; !backlog_.empty() && in_flight_ < sq_entries_; count++) {
+					push(backlog_.front());
+					backlog_.pop_front();
+					in_flight_++;
+				}
+				enter(count);
+			}
+
+			// Writes the entry for operation into the submission ring; a null
+			// operation wakes the reaper. Called with submit_mutex_ held.
+			void push(Operation* operation) {
+				unsigned tail = *sq_tail_;
+				unsigned index = tail & *sq_mask_;
+				io_uring_sqe& sqe = sqes_[index];
+				std::memset(&sqe, 0, sizeof(sqe));
+				sqe.fd = file_.handle;
+				sqe.user_data = (uint64_t)operation;
+				// Buffered writes would otherwise run inline in the reaper
+				// whenever they need not block, holding up completions.
+				if (operation != nullptr)
+					sqe.flags = IOSQE_ASYNC;
+				if (operation == nullptr)
+					sqe.opcode = IORING_OP_NOP;
+				else if (operation->index == operation->batch->requests.size())
+					sqe.opcode = IORING_OP_FSYNC;
+				else {
+					auto& request = operation->batch->requests[operation->index];
+					byte_t* data = request.data + operation->done;
+					num_t length = std::min<num_t>(request.length - operation->done, MaxTransfer);
+					num_t chunk = (data - buffer_) / MaxTransfer;
+					bool fixed = registered_ && data >= buffer_ && data + length <= buffer_ + buffer_size_ && (data + length - 1 - buffer_) / MaxTransfer == chunk;
+					if (operation->batch->write)
+						sqe.opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+					else
+						sqe.opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+					sqe.off = request.offset + operation->done;
+					sqe.addr = (uint64_t)data;
+					sqe.len = (unsigned)length;
+					sqe.buf_index = fixed ? (uint16_t)chunk : 0;
+				}
+				sq_array_[index] = index;
+				std::atomic_ref<unsigned>(*sq_tail_).store(tail + 1, std::memory_order_release);
+			}
+
+			// Hands count pushed entries to the kernel; called with submit_mutex_
+			// held so no other thread submits them first.
+			void enter(unsigned count) {
+				while (count > 0) {
+					long res = syscall(__NR_io_uring_enter, ring_fd_, count, 0, 0, nullptr, 0);
+					if (res > 0)
+						count -= (unsigned)res;
+					else if (res < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+						throw new std::runtime_error("Unable to submit I/O");
+				}
+			}
+
+			void release() {
+				std::lock_guard guard(submit_mutex_);
+				in_flight_--;
+			}
+
+			// Requeues an operation in the slot it already holds.
+			void resubmit(Operation* operation) {
+				std::lock_guard guard(submit_mutex_);
+				push(operation);
+				enter(1);
+			}
+
+			void reap() {
+				while (true) {
+					unsigned head = *cq_head_;
+					unsigned tail = std::atomic_ref<unsigned>(*cq_tail_).load(std::memory_order_acquire);
+					if (head == tail) {
+						syscall(__NR_io_uring_enter, ring_fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+						continue;
+					}
+					std::vector<io_uring_cqe> events;
+					for (; head != tail; head++)
+						events.push_back(cqes_[head & *cq_mask_]);
+					std::atomic_ref<unsigned>(*cq_head_).store(head, std::memory_order_release);
+					for (auto& event : events) {
+						auto operation = (Operation*)event.user_data;
+						if (operation == nullptr) {
+							std::lock_guard guard(submit_mutex_);
+							waking_ = false;
+							if (stopping_)
+								return;
+							continue;
+						}
+						if (event.res == -EINTR || event.res == -EAGAIN) {
+							resubmit(operation);
+							continue;
+						}
+						auto& batch = operation->batch;
+						if (operation->index == batch->requests.size()) {
+							batch->ok = batch->ok.load() && event.res >= 0;
+							finish(batch);
+						}
+						else {
+							auto& request = batch->requests[operation->index];
+							bool ok = event.res > 0 || request.length == 0;
+							if (ok && (operation->done += event.res) < request.length) {
+								resubmit(operation);
+								continue;
+							}
+							if (complete(batch, ok)) {
+								operation->index = batch->requests.size();
+								resubmit(operation);
+								continue;
+							}
+						}
+						delete operation;
+						release();
+					}
+					pump();
+				}
+			}
+#endif
+		};
+	}
+}
@@ -2,8 +2,34 @@
 #include <iostream>
 #include <iomanip>
 #include <chrono>
+#include <cmath>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <string>
+#include <memory>
+#include <cstdio>
+#include <random>
+#include <cstdint>
+#include <fstream>
 
 #define LARGE
+#define ALLOC_BENCH
+#define IO_BENCH
+#define CONCURRENT_BENCH
+#define FILE_STRESS
+#define DIRECTORY_BENCH
+#define SMALL_FILES
+#define CLONE_BENCH
+#define CHECKPOINT_BENCH
+#define JOURNAL_BENCH
+#define ASYNC_IO_BENCH
+#define CACHE_BENCH
+#define LAYOUT_BENCH
+#define HUGE_PAGE_BENCH
+#define RECLAIM_BENCH
+#define FORMAT_BENCH
+#define GROW_BENCH
 
 #define TIME_MESURE(a) { \
 auto start = std::chrono::high_resolution_clock::now(); \
@@ -43,32 +69,32 @@ int main()
 #ifdef LARGE
     {
         auto file = inst_t::FileReference::fileAt(0, &inst);
-        TIME_MESURE(file.resizeFile(1024ULL * 1024 * 3072););
+        TIME_MESURE(file.resizeFile(1024ULL * 1024 * 3072, true););
         print_payload();
     }
     {
         auto file = inst_t::FileReference::fileAt(0, &inst);
-        TIME_MESURE(file.resizeFile(3675););
+        TIME_MESURE(file.resizeFile(3675, true););
         print_payload();
     }
     {
         auto file = inst_t::FileReference::fileAt(0, &inst);
-        TIME_MESURE(file.resizeFile(1024 * 1024 * 500););
+        TIME_MESURE(file.resizeFile(1024 * 1024 * 500, true););
         print_payload();
     }
     {
         auto file = inst_t::FileReference::fileAt(1, &inst);
-        TIME_MESURE(file.resizeFile(1024 * 1024 * 500););
+        TIME_MESURE(file.resizeFile(1024 * 1024 * 500, true););
         print_payload();
     }
     {
         auto file = inst_t::FileReference::fileAt(1, &inst);
-        TIME_MESURE(file.resizeFile(1024 * 1024 * 2););
+        TIME_MESURE(file.resizeFile(1024 * 1024 * 2, true););
         print_payload();
     }
     {
         auto file = inst_t::FileReference::fileAt(1, &inst);
-        TIME_MESURE(file.resizeFile(1024 * 1024 * 500););
+        TIME_MESURE(file.resizeFile(1024 * 1024 * 500, true););
         print_payload();
     }
 #endif
@@ -89,23 +115,624 @@ int main()
         TIME_MESURE(
             for (int i = 0; i < FileCount; i++)
             {
-                auto file = inst_t::FileReference::fileAt(i + 2, &inst);
-                if (!file.exsits())
-                    file.createFile();
-                file.resizeFile(FileSize);
+                auto file = inst_t::FileReference::create(&inst);
+                file.resizeFile(FileSize, true);
             }
         );
         print_payload();
+        std::cout << "Files: " << inst.fileCount() << '\n';
         TIME_MESURE(
-            for (int i = 0; i < FileCount; i++)
-            {
-                auto file = inst_t::FileReference::fileAt(i + 2, &inst);
-                if (file.exsits())
-                    file.deletFile();
-            }
+            for (auto& file : inst_t::API::ListFiles(&inst))
+                file.deletFile();
         );
         print_payload();
     }
+#ifdef ALLOC_BENCH
+    {
+        using bench_t = TTFileSystem::MemoryInstance<4096, 1024, 256>;
+        constexpr const int Iterations = 100000;
+
+        auto bench = bench_t{};
+        for (int fill : { 0, 25, 50, 75, 90, 95, 99 }) {
+            while (bench.payload() * 100 < bench.BlockCount * fill)
+                bench.allocateSingleBlock();
+
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < Iterations; i++)
+                bench.freeSingleBlock(bench.allocateSingleBlock());
+            auto end = std::chrono::high_resolution_clock::now();
+            std::chrono::duration<double, std::nano> elapsed = end - start;
+            std::cout << "Fill " << std::setw(3) << fill << "%: " << elapsed.count() / Iterations << " ns/alloc+free\n";
+        }
+    }
+#endif
+#ifdef IO_BENCH
+    {
+        using bench_t = TTFileSystem::MemoryInstance<4096, 1024, 64>;
+        constexpr const uint64_t FileSize = 1024 * 1024 * 64;
+
+        auto bench = bench_t{};
+        auto file = bench_t::FileReference::fileAt(0, &bench);
+        file.createFile();
+        file.resizeFile(FileSize, true);
+
+        std::vector<TTFileSystem::byte_t> buffer(FileSize, 1);
+        auto report = [](const char* name, std::chrono::duration<double, std::milli> elapsed) {
+            std::cout << name << ": " << elapsed.count() << " ms, " << FileSize / 1024.0 / 1024.0 / (elapsed.count() / 1000) << " MB/s\n";
+            };
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (auto it = bench_t::FileReference::DataIterator<uint64_t>(&file), end = bench_t::FileReference::DataIterator<uint64_t>(&file, FileSize / sizeof(uint64_t)); it != end; ++it)
+            it.set(1);
+        report("Iterator write", std::chrono::high_resolution_clock::now() - start);
+
+        start = std::chrono::high_resolution_clock::now();
+        uint64_t sum = 0;
+        for (auto it = bench_t::FileReference::DataIterator<uint64_t>(&file), end = bench_t::FileReference::DataIterator<uint64_t>(&file, FileSize / sizeof(uint64_t)); it != end; ++it)
+            sum += *it;
+        report("Iterator read ", std::chrono::high_resolution_clock::now() - start);
+
+        start = std::chrono::high_resolution_clock::now();
+        file.write(0, buffer);
+        report("Bulk write    ", std::chrono::high_resolution_clock::now() - start);
+
+        start = std::chrono::high_resolution_clock::now();
+        file.read(0, buffer);
+        report("Bulk read     ", std::chrono::high_resolution_clock::now() - start);
+
+        start = std::chrono::high_resolution_clock::now();
+        uint64_t span_sum = 0, span_count = 0;
+        file.forEachSpan(0, FileSize, [&](std::span<const TTFileSystem::byte_t> span) {
+            for (size_t i = 0; i + sizeof(uint64_t) <= span.size(); i += sizeof(uint64_t)) {
+                uint64_t word;
+                std::memcpy(&word, span.data() + i, sizeof(uint64_t));
+                span_sum += word;
+            }
+            span_count++;
+            });
+        report("Span visit    ", std::chrono::high_resolution_clock::now() - start);
+        std::cout << "Spans: " << span_count << '\n';
+
+        std::vector<TTFileSystem::byte_t> copy(FileSize);
+        start = std::chrono::high_resolution_clock::now();
+        std::memcpy(copy.data(), buffer.data(), FileSize);
+        report("memcpy        ", std::chrono::high_resolution_clock::now() - start);
+
+        if (sum != FileSize / sizeof(uint64_t) || span_sum != FileSize / sizeof(uint64_t) * 0x0101010101010101ULL || copy[FileSize - 1] != 1)
+            std::cout << "Data mismatch\n";
+    }
+#endif
+#ifdef CONCURRENT_BENCH
+    {
+        using bench_t = TTFileSystem::MemoryInstance<4096, 1024, 256>;
+        constexpr const int Iterations = 200000;
+        constexpr const int Batch = 64;
+
+        auto bench = bench_t{};
+        std::mutex lock;
+        auto run = [&](int threads, bool concurrent) {
+            bench.setConcurrent(concurrent);
+            std::vector<std::thread> workers;
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int t = 0; t < threads; t++)
+                workers.emplace_back([&]() {
+                    TTFileSystem::num_t blocks[Batch];
+                    for (int i = 0; i < Iterations / Batch; i++) {
+                        for (auto& block : blocks) {
+                            if (concurrent)
+                                block = bench.allocateSingleBlock();
+                            else {
+                                std::lock_guard guard(lock);
+                                block = bench.allocateSingleBlock();
+                            }
+                        }
+                        for (auto block : blocks) {
+                            if (concurrent)
+                                bench.freeSingleBlock(block);
+                            else {
+                                std::lock_guard guard(lock);
+                                bench.freeSingleBlock(block);
+                            }
+                        }
+                    }
+                    });
+            for (auto& worker : workers)
+                worker.join();
+            std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+            return threads * (double)(Iterations / Batch * Batch) / elapsed.count() / 1e6;
+            };
+
+        for (int threads : { 1, 2, 4, 8, 16, 32 }) {
+            double locked = run(threads, false);
+            double atomic = run(threads, true);
+            std::cout << "Threads " << std::setw(2) << threads << ": mutex " << std::setw(7) << locked << " Mops/s, concurrent " << std::setw(7) << atomic << " Mops/s\n";
+        }
+        if (bench.payload() != 1)
+            std::cout << "Allocator leak\n";
+    }
+#endif
+#ifdef FILE_STRESS
+    {
+        using bench_t = TTFileSystem::MemoryInstance<4096, 1024, 256>;
+        constexpr const int Operations = 20000;
+        constexpr const TTFileSystem::num_t FileSize = 1024 * 1024;
+        constexpr const TTFileSystem::num_t Chunk = 4096 * 4;
+        constexpr const int Directories = 64;
+        // The files and directories share lock stripes, and the string heap
+        // lands on the first of them.
+        constexpr const TTFileSystem::num_t DirectoryBase = bench_t::LockStripes;
+        constexpr const TTFileSystem::num_t FileBase = bench_t::LockStripes * 2;
+
+        auto bench = bench_t{};
+        std::mutex lock;
+        auto run = [&](int threads, bool concurrent) {
+            bench.setConcurrent(concurrent);
+            for (int t = 0; t < threads; t++) {
+                auto file = bench_t::FileReference::fileAt(FileBase + t, &bench);
+                file.createFile();
+                file.resizeFile(FileSize, true);
+            }
+            // The files move between the directories under long names, so links
+            // take crossing pairs of stripes and rename through the string heap.
+            for (int d = 0; d < Directories; d++) {
+                auto dir = bench_t::FileReference::fileAt(DirectoryBase + d, &bench);
+                dir.createFile();
+                dir.makeDirectory();
+            }
+            std::vector<int> homes(threads, -1);
+            std::vector<std::thread> workers;
+            std::atomic<int> errors{ 0 };
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int t = 0; t < threads; t++)
+                workers.emplace_back([&, t]() {
+                    auto file = bench_t::FileReference::fileAt(FileBase + t, &bench);
+                    std::string name = "stress file " + std::to_string(t) + " with a long name";
+                    std::vector<TTFileSystem::byte_t> out(Chunk, (TTFileSystem::byte_t)t), in(Chunk);
+                    uint64_t seed = t * 0x9E3779B97F4A7C15ULL + 1;
+                    for (int i = 0; i < Operations; i++) {
+                        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                        TTFileSystem::num_t offset = (seed >> 33) % (FileSize - Chunk);
+                        std::unique_lock guard(lock, std::defer_lock);
+                        if (!concurrent)
+                            guard.lock();
+                        switch (i % 8) {
+                        case 0:
+                            file.resizeFile(FileSize / 2 + offset);
+                            file.resizeFile(FileSize);
+                            break;
+                        case 1:
+                        case 2:
+                            file.write(offset, out);
+                            break;
+                        case 3: {
+                            auto dir = bench_t::FileReference::fileAt(DirectoryBase + (seed >> 40) % Directories, &bench);
+                            if (homes[t] >= 0 && !bench_t::FileReference::fileAt(DirectoryBase + homes[t], &bench).unlink(name))
+                                errors++;
+                            dir.link(name, file);
+                            homes[t] = (int)(dir.getIndex() - DirectoryBase);
+                            break;
+                        }
+                        default:
+                            file.read(offset, in);
+                            if (in[0] != 0 && in[0] != (TTFileSystem::byte_t)t)
+                                errors++;
+                        }
+                    }
+                    });
+            for (auto& worker : workers)
+                worker.join();
+            std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+            for (int t = 0; t < threads; t++) {
+                if (homes[t] >= 0)
+                    bench_t::FileReference::fileAt(DirectoryBase + homes[t], &bench).unlink(bench_t::FileReference::fileAt(FileBase + t, &bench).getName());
+                bench_t::FileReference::fileAt(FileBase + t, &bench).deletFile();
+            }
+            for (int d = 0; d < Directories; d++)
+                bench_t::FileReference::fileAt(DirectoryBase + d, &bench).deletFile();
+            if (errors != 0)
+                std::cout << "Data mismatch\n";
+            return threads * (double)Operations / elapsed.count() / 1e3;
+            };
+
+        for (int threads : { 1, 2, 4, 8, 16, 32 }) {
+            double locked = run(threads, false);
+            double per_file = run(threads, true);
+            std::cout << "Files " << std::setw(2) << threads << ": global mutex " << std::setw(8) << locked << " Kops/s, per-file " << std::setw(8) << per_file << " Kops/s\n";
+        }
+    }
+#endif
+#ifdef DIRECTORY_BENCH
+    {
+        using bench_t = TTFileSystem::MemoryInstance<512, 1024, 512>;
+        constexpr const int EntryCount = 100000;
+        constexpr const int Depth = 32;
+        constexpr const int Iterations = 100000;
+
+        auto bench = std::make_unique<bench_t>();
+        auto root = bench_t::API::Root(bench.get());
+        auto dir = bench_t::API::CreateDirectory(root, "big");
+        std::vector<std::string> names;
+        for (int i = 0; i < EntryCount; i++)
+            names.push_back("file" + std::to_string(i));
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (auto& name : names)
+            bench_t::API::CreateFile(dir, name);
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "Create: " << elapsed.count() / EntryCount << " ns/entry\n";
+        std::cout << "Blocks used: " << bench->payload() << '\n';
+
+        int missing = 0;
+        start = std::chrono::high_resolution_clock::now();
+        for (auto& name : names)
+            missing += !dir.lookup(name);
+        elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "Lookup in " << EntryCount << " entries: " << elapsed.count() / EntryCount << " ns\n";
+
+        std::string path;
+        auto current = root;
+        for (int d = 0; d < Depth; d++) {
+            current = bench_t::API::CreateDirectory(current, "dir" + std::to_string(d));
+            path += "/dir" + std::to_string(d);
+        }
+        start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < Iterations; i++)
+            missing += !bench_t::API::Resolve(bench.get(), path);
+        elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "Resolve depth " << Depth << ": " << elapsed.count() / Iterations << " ns\n";
+        if (missing != 0)
+            std::cout << "Lookup failed\n";
+    }
+#endif
+#ifdef SMALL_FILES
+    {
+        using bench_t = TTFileSystem::MemoryInstance<4096, 1024, 64, 65536>;
+        constexpr const int FileCount = 60000;
+        constexpr const int Iterations = 1000000;
+
+        auto bench = std::make_unique<bench_t>();
+        std::vector<bench_t::FileReference> files;
+        std::vector<TTFileSystem::byte_t> data(2048, 0x42);
+        for (int i = 0; i < FileCount; i++) {
+            files.push_back(bench_t::FileReference::create(bench.get()));
+            files.back().write(0, std::span(data).first(16 + i % 1024));
+        }
+        std::cout << "Small files " << FileCount << ": " << bench->payload() << " blocks\n";
+
+        std::vector<TTFileSystem::byte_t> buffer(2048);
+        TTFileSystem::num_t sum = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < Iterations; i++)
+            sum += files[(TTFileSystem::num_t)i * 7919 % FileCount].read(0, buffer);
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "Small read: " << elapsed.count() / Iterations << " ns (" << sum / Iterations << " bytes avg)\n";
+    }
+#endif
+#ifdef CLONE_BENCH
+    {
+        using bench_t = TTFileSystem::MemoryInstance<4096, 1024, 64>;
+        constexpr const TTFileSystem::num_t FileSize = 128 * 1024 * 1024;
+
+        auto bench = std::make_unique<bench_t>();
+        auto source = bench_t::FileReference::create(bench.get());
+        source.resizeFile(FileSize, true);
+        TTFileSystem::num_t used = bench->payload();
+
+        auto start = std::chrono::high_resolution_clock::now();
+        auto copy = source.clone();
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "Clone " << FileSize / (1024 * 1024) << " MiB: " << elapsed.count() << " us, " << bench->payload() - used << " new blocks\n";
+
+        std::vector<TTFileSystem::byte_t> data(4096, 0x42);
+        start = std::chrono::high_resolution_clock::now();
+        for (TTFileSystem::num_t offset = 0; offset < FileSize; offset += FileSize / 256)
+            copy.write(offset, data);
+        elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "256 first writes: " << elapsed.count() << " us, " << bench->payload() - used << " new blocks\n";
+    }
+#endif
+#ifdef CHECKPOINT_BENCH
+    {
+        using bench_t = TTFileSystem::MemoryInstance<4096, 1024, 64>;
+        constexpr const TTFileSystem::num_t FileSize = 128 * 1024 * 1024;
+
+        auto bench = std::make_unique<bench_t>();
+        auto file = bench_t::FileReference::create(bench.get());
+        std::vector<TTFileSystem::byte_t> data(FileSize, 0x42);
+        file.write(0, data);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        TTFileSystem::num_t size = bench->checkpoint("checkpoint_0.delta");
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "Full checkpoint: " << elapsed.count() << " ms, " << size / 1024 << " KiB of " << bench_t::TotalSize / 1024 << " KiB\n";
+
+        for (TTFileSystem::num_t i = 0; i < 256; i++)
+            file.write(i * 7919 * 4096 % FileSize, std::span(data).first(4096));
+        start = std::chrono::high_resolution_clock::now();
+        size = bench->checkpoint("checkpoint_1.delta");
+        elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "Checkpoint after 256 writes: " << elapsed.count() << " ms, " << size / 1024 << " KiB\n";
+
+        auto restored = std::make_unique<bench_t>();
+        start = std::chrono::high_resolution_clock::now();
+        restored->applyCheckpoint("checkpoint_0.delta");
+        restored->applyCheckpoint("checkpoint_1.delta");
+        elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "Restore: " << elapsed.count() << " ms, " << restored->payload() << '/' << bench->payload() << " blocks\n";
+        std::remove("checkpoint_0.delta");
+        std::remove("checkpoint_1.delta");
+    }
+#endif
+#ifdef JOURNAL_BENCH
+    {
+        using bench_t = TTFileSystem::MemoryInstance<4096, 1024, 16>;
+        constexpr const int Operations = 2048;
+
+        std::vector<TTFileSystem::byte_t> data(64, 0x42);
+        for (TTFileSystem::num_t batch : { 1, 8, 64, 512 }) {
+            auto bench = std::make_unique<bench_t>(bench_t::createJournaled("journal.img", "journal.log", batch));
+            auto root = bench_t::API::Root(bench.get());
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < Operations; i++)
+                bench_t::API::CreateFile(root, "file" + std::to_string(i)).write(0, data);
+            bench->commit();
+            std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+            std::cout << "Journal batch " << std::setw(3) << batch << ": " << Operations / elapsed.count() / 1000 << " Kops/s\n";
+        }
+        std::remove("journal.img");
+        std::remove("journal.log");
+    }
+#endif
+#ifdef ASYNC_IO_BENCH
+    {
+        using bench_t = TTFileSystem::MemoryInstance<4096, 1024, 64>;
+        constexpr const TTFileSystem::num_t Blocks = 4096;
+
+        {
+            auto bench = std::make_unique<bench_t>(bench_t::createImage("async.img"));
+            auto root = bench_t::API::Root(bench.get());
+            auto file = bench_t::API::CreateFile(root, "data");
+            file.write(0, std::vector<TTFileSystem::byte_t>(Blocks * 2 * 4096, 0x42));
+            bench->sync();
+        }
+        auto seconds = [](auto start) {
+            return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+            };
+
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            std::vector<TTFileSystem::byte_t> image(bench_t::TotalSize);
+            auto file = TTFileSystem::Platform::openFile("async.img", false);
+            TTFileSystem::Platform::readFile(file, image.data(), image.size());
+            TTFileSystem::Platform::closeFile(file);
+            std::cout << "Load read():    " << bench_t::TotalSize / seconds(start) / (1 << 30) << " GiB/s\n";
+        }
+        for (bool ring : { true, false }) {
+            auto start = std::chrono::high_resolution_clock::now();
+            auto bench = std::make_unique<bench_t>(bench_t::loadImage("async.img", ring));
+            std::cout << "Load " << (ring ? "io_uring: " : "threads:  ") << bench_t::TotalSize / seconds(start) / (1 << 30) << " GiB/s\n";
+
+            // Every other block, so the writes cannot be merged.
+            auto file = bench_t::API::Root(bench.get()).lookup("data");
+            std::vector<TTFileSystem::byte_t> data(4096, 0x17);
+            auto flush = [&](auto&& write) {
+                for (TTFileSystem::num_t i = 0; i < Blocks; i++)
+                    file->write(i * 2 * 4096, data);
+                start = std::chrono::high_resolution_clock::now();
+                write();
+                return Blocks / seconds(start) / 1000;
+                };
+            double submit = 0;
+            double async = flush([&] {
+                auto submitted = std::chrono::high_resolution_clock::now();
+                auto done = bench->flushAsync();
+                submit = seconds(submitted) * 1e6;
+                done.get();
+                });
+            double serial = flush([&] {
+                TTFileSystem::Platform::FileHandle image = TTFileSystem::Platform::openFile("async.img", false);
+                for (TTFileSystem::num_t i = 0; i < Blocks; i++) {
+                    auto& block = bench->getBlock(bench->getIndexedPtr(file->getIndex(), i * 2));
+                    TTFileSystem::Platform::writeFileAt(image, block.data.data() - bench->data_, block.data.data(), 4096);
+                }
+                TTFileSystem::Platform::syncFile(image);
+                TTFileSystem::Platform::closeFile(image);
+                });
+            std::cout << "Flush " << Blocks << " blocks: " << async << " Kblocks/s async (" << submit << " us to submit), " << serial << " Kblocks/s pwrite()\n";
+        }
+        std::remove("async.img");
+    }
+#endif
+#ifdef CACHE_BENCH
+    {
+        // A 256 MiB image behind a 32 MiB cache.
+        using bench_t = TTFileSystem::MemoryInstance<4096, 1024, 64>;
+        constexpr const TTFileSystem::num_t Blocks = 50000;
+        constexpr const TTFileSystem::num_t CacheSize = 32 << 20;
+        constexpr const TTFileSystem::num_t Operations = 200000;
+
+        {
+            auto bench = std::make_unique<bench_t>(bench_t::createImage("cache.img"));
+            auto root = bench_t::API::Root(bench.get());
+            auto file = bench_t::API::CreateFile(root, "data");
+            file.write(0, std::vector<TTFileSystem::byte_t>(Blocks * 4096, 0x42));
+            bench->sync();
+        }
+        auto seconds = [](auto start) {
+            return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+            };
+
+        // Zipfian block ranks (Gray et al.), scattered over the file so hot
+        // blocks are not neighbours.
+        constexpr const double Theta = 0.99;
+        double zeta = 0;
+        for (TTFileSystem::num_t i = 1; i <= Blocks; i++)
+            zeta += 1 / std::pow((double)i, Theta);
+        double alpha = 1 / (1 - Theta);
+        double eta = (1 - std::pow(2.0 / Blocks, 1 - Theta)) / (1 - (1 + std::pow(0.5, Theta)) / zeta);
+        std::mt19937_64 random(42);
+        auto zipf = [&] {
+            double u = std::uniform_real_distribution<double>(0, 1)(random);
+            double uz = u * zeta;
+            TTFileSystem::num_t rank = uz < 1 ? 0 : uz < 1 + std::pow(0.5, Theta) ? 1 : (TTFileSystem::num_t)(Blocks * std::pow(eta * u - eta + 1, alpha));
+            return std::min(rank, Blocks - 1) * 7919 % Blocks;
+            };
+
+        auto bench = std::make_unique<bench_t>(bench_t::openCached("cache.img", CacheSize));
+        auto file = bench_t::API::Root(bench.get()).lookup("data");
+        std::vector<TTFileSystem::byte_t> data(4096, 0x17);
+        auto run = [&](const char* name, TTFileSystem::num_t bytes, auto&& body) {
+            auto before = bench->cacheStats();
+            auto start = std::chrono::high_resolution_clock::now();
+            body();
+            double elapsed = seconds(start);
+            auto after = bench->cacheStats();
+            double accesses = (double)(after.hits - before.hits + after.misses - before.misses);
+            std::cout << name << bytes / elapsed / (1 << 20) << " MiB/s, hit rate " << (after.hits - before.hits) / accesses * 100 << "%, "
+                << after.evictions - before.evictions << " evictions, " << after.write_backs - before.write_backs << " write-backs\n";
+            };
+
+        run("Cached sequential read: ", Blocks * 4096, [&] {
+            std::vector<TTFileSystem::byte_t> chunk(1 << 20);
+            for (TTFileSystem::num_t offset = 0; offset < Blocks * 4096; offset += chunk.size())
+                file->read(offset, chunk);
+            });
+        run("Cached Zipfian read:    ", Operations * 4096, [&] {
+            for (TTFileSystem::num_t i = 0; i < Operations; i++)
+                file->read(zipf() * 4096, data);
+            });
+        run("Cached Zipfian write:   ", Operations * 4096, [&] {
+            for (TTFileSystem::num_t i = 0; i < Operations; i++)
+                file->write(zipf() * 4096, data);
+            bench->sync();
+            });
+        bench.reset();
+        std::remove("cache.img");
+    }
+#endif
+#ifdef LAYOUT_BENCH
+    {
+        // One geometry with the bitmaps between the blocks and split off in front.
+        constexpr const int Iterations = 200;
+        auto bench = [&]<typename bench_t>(const char* name) {
+            auto instance = std::make_unique<bench_t>();
+            TTFileSystem::num_t taken = 0;
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < Iterations; i++)
+                taken += instance->payload();
+            std::chrono::duration<double, std::micro> scan = std::chrono::high_resolution_clock::now() - start;
+            start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < Iterations; i++)
+                instance->rebuildFreeSummary();
+            std::chrono::duration<double, std::micro> summary = std::chrono::high_resolution_clock::now() - start;
+            auto address = reinterpret_cast<std::uintptr_t>(instance->getBlock(1).data.data());
+            std::cout << name << ": payload() " << scan.count() / Iterations << " us, free summary " << summary.count() / Iterations << " us, "
+                << taken / Iterations << " taken, block 1 " << (address % 4096 == 0 ? "page aligned" : "unaligned") << "\n";
+            };
+        bench.template operator()<TTFileSystem::MemoryInstance<4096, 64, 8192>>("Interleaved");
+        bench.template operator()<TTFileSystem::MemoryInstance<4096, 64, 8192, 32768, 4096>>("Split      ");
+    }
+#endif
+#ifdef HUGE_PAGE_BENCH
+    {
+        // Random one-byte reads over 1 GiB of touched blocks.
+        using bench_t = TTFileSystem::MemoryInstance<4096, 1024, 256>;
+        using Policy = TTFileSystem::Platform::MemoryPolicy;
+        constexpr const int Accesses = 20000000;
+
+        for (auto [name, pages] : { std::pair{ "4K pages:         ", Policy::Default }, std::pair{ "Transparent huge: ", Policy::Transparent }, std::pair{ "Huge pages:       ", Policy::Huge } }) {
+            auto bench = std::make_unique<bench_t>(Policy{ pages });
+            for (TTFileSystem::num_t i = 0; i < bench_t::BlockCount; i++)
+                bench->getBlock(i).data[0] = (TTFileSystem::byte_t)i;
+
+            std::uint64_t state = 0x9E3779B97F4A7C15ULL;
+            TTFileSystem::num_t sum = 0;
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < Accesses; i++) {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                sum += bench->getBlock(state % bench_t::BlockCount).data[(state >> 32) % 4096];
+            }
+            std::chrono::duration<double, std::nano> elapsed = std::chrono::high_resolution_clock::now() - start;
+            std::cout << name << elapsed.count() / Accesses << " ns/getBlock, checksum " << sum << "\n";
+        }
+    }
+#endif
+#ifdef RECLAIM_BENCH
+    {
+        using bench_t = TTFileSystem::MemoryInstance<4096, 1024, 64>;
+        // Resident set of the process from /proc, 0 elsewhere.
+        auto resident = [] {
+            std::ifstream statm("/proc/self/statm");
+            TTFileSystem::num_t size = 0, pages = 0;
+            statm >> size >> pages;
+            return pages * 4096 >> 20;
+            };
+
+        for (bool reclaim : { false, true }) {
+            auto bench = std::make_unique<bench_t>();
+            bench->setReclaim(reclaim);
+            auto root = bench_t::API::Root(bench.get());
+            auto before = resident();
+            auto file = bench_t::API::CreateFile(root, "data");
+            file.write(0, std::vector<TTFileSystem::byte_t>(192 << 20, 0x42));
+            auto grown = resident();
+            auto start = std::chrono::high_resolution_clock::now();
+            file.resizeFile(16 << 20);
+            std::chrono::duration<double, std::milli> shrink = std::chrono::high_resolution_clock::now() - start;
+            std::cout << (reclaim ? "Reclaim on:  " : "Reclaim off: ") << "grown +" << grown - before << " MiB, shrunk +" << resident() - before
+                << " MiB for " << (bench->payload() * 4096 >> 20) << " MiB payload, shrink " << shrink.count() << " ms\n";
+        }
+    }
+#endif
+#ifdef FORMAT_BENCH
+    {
+        // 16 GiB volumes, far more than the memory they end up touching.
+        using bench_t = TTFileSystem::MemoryInstance<4096, 4096, 1024>;
+        auto time = [](auto&& body) {
+            auto start = std::chrono::high_resolution_clock::now();
+            body();
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+            return elapsed.count();
+            };
+
+        std::unique_ptr<bench_t> bench;
+        double created = time([&] { bench = std::make_unique<bench_t>(); });
+        bench_t::API::CreateFile(bench_t::API::Root(bench.get()), "data").write(0, std::vector<TTFileSystem::byte_t>(1 << 20, 0x42));
+        double reformatted = time([&] { bench->reformat(); });
+        bench.reset();
+        double imaged = time([&] { bench = std::make_unique<bench_t>(bench_t::createImage("format.img")); });
+        bench.reset();
+        std::remove("format.img");
+        std::cout << "Format 16 GiB: " << created << " ms in memory, " << imaged << " ms as image, " << reformatted << " ms to reformat\n";
+    }
+#endif
+#ifdef GROW_BENCH
+    {
+        // A 16 GiB image that starts with one 4 MiB superblock and grows by one
+        // every time the file written into it gains another 4 MiB.
+        using bench_t = TTFileSystem::MemoryInstance<4096, 1024, 4096>;
+        constexpr const int Grows = 64;
+        auto bench = std::make_unique<bench_t>(bench_t::createImage("grow.img", 1, 1024));
+        auto file = bench_t::API::CreateFile(bench_t::API::Root(bench.get()), "data");
+        std::vector<TTFileSystem::byte_t> chunk(4 << 20, 0x42);
+        file.write(0, std::vector<TTFileSystem::byte_t>(1 << 20, 0x42));
+        auto* first = &file.getBlock(0);
+
+        std::chrono::duration<double, std::micro> grown{ 0 };
+        for (int i = 1; i <= Grows; i++) {
+            auto start = std::chrono::high_resolution_clock::now();
+            bench->grow(i + 1, 1024);
+            grown += std::chrono::high_resolution_clock::now() - start;
+            file.write((1 << 20) + (i - 1) * chunk.size(), chunk);
+        }
+        std::cout << "Grow by " << Grows << " superblocks: " << grown.count() / Grows << " us per grow, image " << (bench->imageSize() >> 20)
+            << " MiB, first block " << (first == &file.getBlock(0) ? "kept" : "moved") << "\n";
+        bench.reset();
+        std::remove("grow.img");
+    }
+#endif
     
     return 0;
 }
\ No newline at end of file